@@ -2,15 +2,17 @@
 #include <GL/glew.h>
 #include <stdexcept>
 #include <string>
-#include <fstream>
 
 #include <App.h>
 #include <QtXml>
 #include <QDomDocument>
 #include <QDomElement>
 #include <QList>
+#include <QtConcurrentRun>
+#include <QThread>
 
 #include <FirstPersonCamera.h>
+#include <Pack.h>
 
 #include <sys/resource.h> // TODO: other platforms
 
@@ -45,12 +47,258 @@ void checkErrors() {
   }
 }
 
-inline mat4 toMat4(const btScalar* columnMajor) {
-  qreal mat[16];
-  for (int i = 0; i < 16; ++i) mat[i] = columnMajor[i];
-  return mat4(mat).transposed();
+const int MESH_HEADER_SIZE = 5 * 4;
+const int MAX_VERTEX_ATTRIBUTES = 8;
+const unsigned int GEOMETRY_POOL_VERTEX_BYTES = 4 * 1024 * 1024;
+const unsigned int GEOMETRY_POOL_INDEX_BYTES = 2 * 1024 * 1024;
+
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+
+// Half floats in mesh files are finite, infinities and NaNs are not handled.
+inline float halfToFloat(quint16 half) {
+  const int exponent = (half >> 10) & 0x1f;
+  const int mantissa = half & 0x3ff;
+  const float magnitude = exponent == 0 ? ldexpf(mantissa, -24) : ldexpf(mantissa | 0x400, exponent - 25);
+  return (half & 0x8000) ? -magnitude : magnitude;
 }
 
+// Nearest half float, out of range values become infinity.
+inline quint16 floatToHalf(float value) {
+  quint32 bits;
+  memcpy(&bits, &value, 4);
+  const quint16 sign = (bits >> 16) & 0x8000;
+  const float magnitude = fabsf(value);
+  if (magnitude != magnitude)
+    return sign | 0x7e00;
+  if (magnitude >= 65520.0f)
+    return sign | 0x7c00;
+  if (magnitude < ldexpf(1, -14))
+    return sign | quint16(floorf(ldexpf(magnitude, 24) + 0.5f)); // Subnormal, rounds up into the normals.
+  int exponent;
+  const float fraction = frexpf(magnitude, &exponent); // In [0.5, 1).
+  const quint32 significand = quint32(floorf(ldexpf(fraction, 11) + 0.5f)); // 1024 to 2048, a carry bumps the exponent.
+  return sign | quint16(((exponent + 14) << 10) + (significand - 1024));
+}
+
+// Describes one vertex attribute as stored in a version 4 .mesh file. The semantic
+// doubles as the attribute unit the shaders bind their inputs to.
+struct VertexAttribute {
+  enum Semantic {
+    Position = 0,
+    Normal,
+    TexCoord0,
+    TexCoord1,
+    TexCoord2
+  };
+
+  enum Type {
+    Float32 = 0,
+    Float16,
+    Snorm16,
+    Snorm10_10_10_2
+  };
+
+  GLenum glType() const {
+    switch (type) {
+      case Float16:         return GL_HALF_FLOAT;
+      case Snorm16:         return GL_SHORT;
+      case Snorm10_10_10_2: return GL_INT_2_10_10_10_REV;
+      default:              return GL_FLOAT;
+    }
+  }
+
+  // Bytes the attribute takes in a vertex.
+  unsigned int size() const {
+    switch (type) {
+      case Float16:
+      case Snorm16:         return components * 2;
+      case Snorm10_10_10_2: return 4;
+      default:              return components * 4;
+    }
+  }
+
+  // Whether the GL can fetch the attribute from vertices of stride bytes and decode can
+  // read it. Positions and normals are handled as vectors, so they need x, y and z.
+  bool isValid(unsigned int stride) const {
+    if (semantic >= MAX_VERTEX_ATTRIBUTES || type > Snorm10_10_10_2 || components < 1 || components > 4)
+      return false;
+    if (type == Snorm10_10_10_2 && components != 4)
+      return false;
+    if ((semantic == Position || semantic == Normal) && components < 3)
+      return false;
+    return quint64(offset) + size() <= stride;
+  }
+
+  // Converts the attribute of one vertex to floats the way the GL would when fetching it.
+  void decode(const char* vertex, float* out) const {
+    const char* data = vertex + offset;
+    for (int i = 0; i < components; ++i) {
+      switch (type) {
+        case Float16: {
+          quint16 half;
+          memcpy(&half, data + i * 2, 2);
+          out[i] = halfToFloat(half);
+          break;
+        }
+        case Snorm16: {
+          qint16 value;
+          memcpy(&value, data + i * 2, 2);
+          out[i] = normalized ? qMax(value / 32767.0f, -1.0f) : value;
+          break;
+        }
+        case Snorm10_10_10_2: {
+          quint32 packed;
+          memcpy(&packed, data, 4);
+          const int bits = i < 3 ? 10 : 2;
+          const int value = qint32(packed << (32 - bits - 10 * i)) >> (32 - bits); // Sign extended.
+          out[i] = normalized ? qMax(value / float((1 << (bits - 1)) - 1), -1.0f) : value;
+          break;
+        }
+        default:
+          memcpy(out + i, data + i * 4, 4);
+          break;
+      }
+    }
+  }
+
+  // The inverse of decode, rounding to the nearest value the type can hold.
+  void encode(const float* in, char* vertex) const {
+    char* data = vertex + offset;
+    if (type == Snorm10_10_10_2) {
+      quint32 packed = 0;
+      for (int i = 0; i < components; ++i) {
+        const int bits = i < 3 ? 10 : 2;
+        packed |= (quint32(toInteger(in[i], bits)) & ((1u << bits) - 1)) << (10 * i);
+      }
+      memcpy(data, &packed, 4);
+      return;
+    }
+
+    for (int i = 0; i < components; ++i) {
+      switch (type) {
+        case Float16: {
+          const quint16 half = floatToHalf(in[i]);
+          memcpy(data + i * 2, &half, 2);
+          break;
+        }
+        case Snorm16: {
+          const qint16 value = toInteger(in[i], 16);
+          memcpy(data + i * 2, &value, 2);
+          break;
+        }
+        default:
+          memcpy(data + i * 4, in + i, 4);
+          break;
+      }
+    }
+  }
+
+  // A signed integer of the given width, values in [-1, 1] span it if normalized.
+  int toInteger(float value, int bits) const {
+    const int high = (1 << (bits - 1)) - 1;
+    const int rounded = int(floorf((normalized ? value * high : value) + 0.5f));
+    return qBound(normalized ? -high : -high - 1, rounded, high);
+  }
+
+  quint8 semantic;
+  quint8 components;
+  quint8 type;
+  quint8 normalized;
+  quint32 offset;
+};
+
+// Layout of a vertex. Quantized positions are decoded as positionOffset + positionScale * p,
+// the scale is uniform so the decode can be folded into the model matrix without
+// skewing normals.
+struct VertexFormat {
+  VertexFormat() {
+    stride = 0;
+    nAttributes = 0;
+    positionOffset[0] = positionOffset[1] = positionOffset[2] = 0;
+    positionScale = 1;
+  }
+
+  // Format implied by vertexSize in version 1-3 files (all 32-bit floats).
+  static VertexFormat fromVertexSize(unsigned int vertexSize) {
+    VertexFormat format;
+    format.stride = vertexSize;
+    format.add(VertexAttribute::Position, 3, VertexAttribute::Float32, false, 0);
+    format.add(VertexAttribute::Normal, 3, VertexAttribute::Float32, false, 3*4);
+    if (vertexSize >= 32)
+      format.add(VertexAttribute::TexCoord0, 2, VertexAttribute::Float32, false, 6*4);
+    if (vertexSize >= 40)
+      format.add(VertexAttribute::TexCoord1, 2, VertexAttribute::Float32, false, 8*4);
+    if (vertexSize >= 48)
+      format.add(VertexAttribute::TexCoord2, 2, VertexAttribute::Float32, false, 10*4);
+    return format;
+  }
+
+  void add(int semantic, int components, int type, bool normalized, unsigned int offset) {
+    VertexAttribute& attribute = attributes[nAttributes++];
+    attribute.semantic = semantic;
+    attribute.components = components;
+    attribute.type = type;
+    attribute.normalized = normalized;
+    attribute.offset = offset;
+  }
+
+  // Same attribute layout, the position decode is per mesh and does not matter here.
+  bool sameLayout(const VertexFormat& other) const {
+    if (stride != other.stride || nAttributes != other.nAttributes)
+      return false;
+    for (int i = 0; i < nAttributes; ++i) {
+      const VertexAttribute& a = attributes[i];
+      const VertexAttribute& b = other.attributes[i];
+      if (a.semantic != b.semantic || a.components != b.components || a.type != b.type ||
+          a.normalized != b.normalized || a.offset != b.offset)
+        return false;
+    }
+    return true;
+  }
+
+  // Every attribute valid and each semantic used at most once.
+  bool isValid() const {
+    quint32 semantics = 0;
+    for (int i = 0; i < nAttributes; ++i) {
+      const VertexAttribute& attribute = attributes[i];
+      if (!attribute.isValid(stride) || (semantics & (1u << attribute.semantic)))
+        return false;
+      semantics |= 1u << attribute.semantic;
+    }
+    return true;
+  }
+
+  bool usesType(int type) const {
+    for (int i = 0; i < nAttributes; ++i) {
+      if (attributes[i].type == type)
+        return true;
+    }
+    return false;
+  }
+
+  bool isQuantized() const {
+    return positionScale != 1 || positionOffset[0] != 0 || positionOffset[1] != 0 || positionOffset[2] != 0;
+  }
+
+  // Expects the vertex array object and the vertex buffer to be bound.
+  void apply() const {
+    for (int i = 0; i < nAttributes; ++i) {
+      const VertexAttribute& attribute = attributes[i];
+      glVertexAttribPointer(attribute.semantic, attribute.components, attribute.glType(),
+        attribute.normalized ? GL_TRUE : GL_FALSE, stride, BUFFER_OFFSET(attribute.offset));
+      glEnableVertexAttribArray(attribute.semantic);
+    }
+  }
+
+  unsigned int stride;
+  int nAttributes;
+  VertexAttribute attributes[MAX_VERTEX_ATTRIBUTES];
+  float positionOffset[3];
+  float positionScale;
+};
+
 class VertexBuffer {
 private:
   friend class Renderer;
@@ -67,44 +315,470 @@ private:
 
 class Texture {
 public:
+  Texture() {
+    id = 0;
+    target = GL_TEXTURE_2D;
+    width = height = 0;
+    internalFormat = GL_RGBA8;
+    levels = 1;
+    compressed = false;
+    array = NULL;
+    layer = 0;
+    users = 0;
+  }
+
   GLuint getID() const { // TODO: this should not be necessary
     return id;
   }
 
+  // The texture array holding a copy of this texture (see Renderer::buildTextureArrays),
+  // NULL if it isn't in one.
+  Texture* getArray() const {
+    return array;
+  }
+
+  int getLayer() const {
+    return layer;
+  }
+
 private:
   friend class Renderer;
   GLuint id;
+  GLenum target;
   unsigned int width, height;
+  GLenum internalFormat;
+  int levels;
+  bool compressed;
+  Texture* array;
+  int layer;
+  int users; // How often the Renderer handed the texture out.
 };
 
 class Shader {
 private:
   friend class Renderer;
   GLenum vertexShader, pixelShader, program;
+  QString name;
+  QByteArray cacheKey; // Empty when program binaries aren't supported.
+  bool pending; // Compiled and linked, but the status hasn't been checked yet.
+  QVector<GLint> uniformLocations; // Indexed by UniformId, -1 for inactive uniforms.
+  QVector<GLint> samplerUnits; // Last unit set through Renderer::setSampler, -1 if unknown.
+  bool instanced; // Reads its model matrix from the instanceModel attribute.
+  bool textureArrays; // texture0 is a sampler2DArray, indexed by the instanceLayer attribute.
+};
+
+// Interned uniform name, see Renderer::uniformId.
+typedef int UniformId;
+
+// Values that stay the same for every object in a frame, the std140 layout of the Frame
+// uniform block the scene shaders declare. Set with Renderer::setFrameConstants.
+struct FrameConstants {
+  GLfloat proj[16];
+  GLfloat view[16];
+  GLfloat shadowProj[16];
+  GLfloat shadowModelView[16];
+  GLfloat bias[16];
+  GLfloat lightDir[4]; // vec3, padded to 16 bytes.
+  GLfloat camPosition[4];
+};
+
+const GLuint FRAME_UNIFORM_BINDING = 0;
+
+// Instanced shaders bind their mat4 instanceModel attribute here, it takes 4 locations.
+// A float instanceLayer follows it, shaders with texture arrays bind that one as well.
+const GLuint INSTANCE_ATTRIBUTE = MAX_VERTEX_ATTRIBUTES;
+const GLuint INSTANCE_LAYER_ATTRIBUTE = INSTANCE_ATTRIBUTE + 4;
+// Per instance data: the model matrix, the texture array layer and padding to 16 bytes.
+const int INSTANCE_FLOATS = 20;
+
+// Big vertex and index buffers shared by all meshes with the same vertex layout and
+// index type. Meshes are sub-allocated and drawn with a base vertex, so consecutive
+// draws from one pool don't need to switch vertex array objects.
+class GeometryPool {
+private:
+  friend class Renderer;
+  VertexFormat format;
+  GLenum indexType;
+  unsigned int indexSize;
+  GLuint vao, vertexBuffer, indexBuffer;
+  unsigned int vertexCapacity, verticesUsed; // In vertices.
+  unsigned int indexCapacity, indicesUsed;   // In indices.
 };
 
 class Mesh {
 public:
-  ~Mesh() {
-    // TODO: delete vao?
+  Mesh() {
+    pool = NULL;
+    firstIndex = 0;
+    baseVertex = 0;
+    indexType = GL_UNSIGNED_INT;
+    nVertices = vertexSize = nIndices = indexSize = 0;
+    version = 0;
+    aabbMin.setValue(0, 0, 0);
+    aabbMax.setValue(0, 0, 0);
+  }
+
+  const GeometryPool* getPool() const {
+    return pool;
+  }
+
+  unsigned int getVertexCount() const {
+    return nVertices;
+  }
+
+  // False while a requested mesh is still being loaded, drawing it is a no-op until then.
+  bool isLoaded() const {
+    return pool != NULL;
+  }
+
+  // Folds the decode of quantized positions into a model(view) matrix.
+  void applyPositionTransform(mat4& matrix) const {
+    if (!format.isQuantized())
+      return;
+    matrix.translate(format.positionOffset[0], format.positionOffset[1], format.positionOffset[2]);
+    matrix.scale(format.positionScale);
+  }
+
+  // Offset and scale that decode the z of a quantized position, for shaders that read the
+  // raw attribute rather than going through the model matrix.
+  vec2 positionZDecode() const {
+    return vec2(format.positionOffset[2], format.positionScale);
+  }
+
+  // World space bounds of the mesh moved by transform, from the local bounds worked out
+  // when it was loaded.
+  void getAabb(const btTransform& transform, btVector3& worldMin, btVector3& worldMax) const {
+    btTransformAabb(aabbMin, aabbMax, 0, transform, worldMin, worldMax);
   }
 
 private:
   friend class Renderer;
-  IndexBuffer* indexBuffer;
-  VertexBuffer* vertexBuffer;
-  GLuint vao;
+  GeometryPool* pool;
+  unsigned int firstIndex; // Offset into the pool index buffer, in indices.
+  GLint baseVertex;        // Offset into the pool vertex buffer, in vertices.
+  VertexFormat format;
+  GLenum indexType;
   unsigned int nVertices, vertexSize, nIndices, indexSize;
   unsigned int version;
+  btVector3 aabbMin, aabbMax; // Of the decoded positions.
+};
+
+// Result of decoding an image on a worker thread, uploaded later on the GL thread.
+struct DecodedImage {
+  DecodedImage() {
+    compressedFormat = 0;
+    width = height = levels = 0;
+  }
+
+  QImage image;
+  // A block compressed .dds file (see textool.py), used instead of image if not empty.
+  QByteArray compressed;
+  GLenum compressedFormat;
+  int width, height, levels;
+  QString error;
+};
+
+const int DDS_HEADER_SIZE = 128;
+
+inline int compressedBlockBytes(GLenum format) {
+  return format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+}
+
+// Fills in the compressed part of decoded from a .dds written by textool.py.
+bool parseDds(const QByteArray& data, const QString& fileName, DecodedImage& decoded) {
+  const quint32* header = reinterpret_cast<const quint32*>(data.constData());
+  if (data.size() < DDS_HEADER_SIZE || memcmp(header, "DDS ", 4) != 0) {
+    decoded.error = fileName + " is not a .dds file!";
+    return false;
+  }
+
+  const char* fourCC = data.constData() + 84;
+  if (memcmp(fourCC, "DXT1", 4) == 0 && GLEW_EXT_texture_compression_s3tc)
+    decoded.compressedFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  else if (memcmp(fourCC, "DXT5", 4) == 0 && GLEW_EXT_texture_compression_s3tc)
+    decoded.compressedFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  else if (memcmp(fourCC, "ATI2", 4) == 0)
+    decoded.compressedFormat = GL_COMPRESSED_RG_RGTC2; // Core since 3.0.
+  else {
+    decoded.error = "Unsupported compression in " + fileName + "!";
+    return false;
+  }
+
+  decoded.height = header[3];
+  decoded.width = header[4];
+  decoded.levels = qMax(header[7], quint32(1));
+
+  qint64 size = DDS_HEADER_SIZE;
+  for (int level = 0, w = decoded.width, h = decoded.height; level < decoded.levels; ++level) {
+    size += qint64((w + 3) / 4) * ((h + 3) / 4) * compressedBlockBytes(decoded.compressedFormat);
+    w = qMax(w / 2, 1);
+    h = qMax(h / 2, 1);
+  }
+  if (decoded.width == 0 || decoded.height == 0 || size > data.size()) {
+    decoded.error = "Header of " + fileName + " does not match the file size!";
+    return false;
+  }
+
+  decoded.compressed = data;
+  return true;
+}
+
+// Prefers a compressed grass.dds next to grass.jpg, textool.py builds those.
+DecodedImage decodeImage(const QString& fileName) {
+  DecodedImage decoded;
+  QImage img;
+
+  QFileInfo info(fileName);
+  QFile dds(info.path() + "/" + info.completeBaseName() + ".dds");
+  if (dds.exists() && dds.open(QIODevice::ReadOnly)) {
+    if (parseDds(dds.readAll(), dds.fileName(), decoded))
+      return decoded;
+    std::cout << decoded.error.toStdString() << " Falling back to " << fileName.toStdString() << "." << std::endl;
+    decoded.error = QString();
+  }
+
+  if (!img.load(fileName)) {
+    decoded.error = "Error opening " + fileName;
+    return decoded;
+  }
+
+  decoded.image = QGLWidget::convertToGLFormat(img);
+  if (decoded.image.isNull())
+    decoded.error = "Error converting " + fileName + " to a format OpenGL prefers!";
+  return decoded;
+}
+
+// A validated .mesh file that is still mapped. The file is opened, mapped and released on
+// the GL thread, Renderer::uploadMesh fills the buffers from the mapping.
+struct MeshData {
+  MeshData() {
+    file = NULL;
+    mapped = NULL;
+    mappedSize = 0;
+    vertexData = indexData = NULL;
+    version = nVertices = nIndices = vertexSize = indexSize = 0;
+    aabbMin.setValue(0, 0, 0);
+    aabbMax.setValue(0, 0, 0);
+  }
+
+  void release() {
+    if (file != NULL) {
+      if (mapped != NULL)
+        file->unmap(mapped);
+      delete file;
+    }
+    file = NULL;
+    mapped = NULL;
+  }
+
+  QFile* file;
+  uchar* mapped;
+  qint64 mappedSize;
+  const char* vertexData;
+  const char* indexData;
+  unsigned int version, nVertices, nIndices, vertexSize, indexSize;
+  VertexFormat format;
+  btVector3 aabbMin, aabbMax;
+  QString error;
 };
 
+// Bounds of the decoded positions, so culling never has to look at the vertices again.
+void computeMeshBounds(MeshData& data) {
+  data.aabbMin.setValue(0, 0, 0);
+  data.aabbMax.setValue(0, 0, 0);
+  const VertexFormat& format = data.format;
+  for (int a = 0; a < format.nAttributes; ++a) {
+    const VertexAttribute& attribute = format.attributes[a];
+    if (attribute.semantic != VertexAttribute::Position || data.nVertices == 0)
+      continue;
+
+    data.aabbMin.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+    data.aabbMax.setValue(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+    float position[4] = {0, 0, 0, 0};
+    for (unsigned int v = 0; v < data.nVertices; ++v) {
+      attribute.decode(data.vertexData + v * data.vertexSize, position);
+      const btVector3 p(position[0], position[1], position[2]);
+      data.aabbMin.setMin(p);
+      data.aabbMax.setMax(p);
+    }
+    const btVector3 offset(format.positionOffset[0], format.positionOffset[1], format.positionOffset[2]);
+    data.aabbMin = offset + data.aabbMin * format.positionScale;
+    data.aabbMax = offset + data.aabbMax * format.positionScale;
+  }
+}
+
+// Validates a mesh held in memory (a mapped file or a pack entry) and fills in data. It only
+// reads the bytes, so it can run on the pool. On failure the caller releases data.
+bool parseMeshData(MeshData& data, const uchar* bytes, qint64 size, const QString& name) {
+  // Format:
+  // format version     |
+  // nVertices          |
+  // nIndices           |  4 bytes each
+  // vertexSize         |
+  // indexSize          |
+  // vertexBuffer (nVertices * vertexSize)
+  // indexBuffer (nIndices * indexSize)
+  //
+  // Version 3 stores welded vertices and 2 byte indices whenever nVertices allows it.
+  // Exported meshes should be run through meshtool.py optimize (vertex cache/overdraw order).
+  //
+  // Version 4 adds a vertex format between the header and the vertex buffer:
+  // nAttributes (4 bytes)
+  // positionOffset (3 floats), positionScale (1 float)
+  // nAttributes * {semantic, components, type, normalized (1 byte each), offset (4 bytes)}
+
+  if (size < MESH_HEADER_SIZE) {
+    data.error = name + " is too small to be a mesh!";
+    return false;
+  }
+
+  const quint32* header = reinterpret_cast<const quint32*>(bytes); // TODO: endianness?
+  data.version    = header[0];
+  data.nVertices  = header[1];
+  data.nIndices   = header[2];
+  data.vertexSize = header[3];
+  data.indexSize  = header[4];
+
+  if (data.version < 1 || data.version > 4) {
+    data.error = "Unknown mesh version!";
+    return false;
+  }
+
+  if (data.indexSize != 2 && data.indexSize != 4) {
+    data.error = "Unsupported index size in " + name + "!";
+    return false;
+  }
+
+  data.format = VertexFormat::fromVertexSize(data.vertexSize);
+  quint64 dataOffset = MESH_HEADER_SIZE;
+  if (data.version >= 4) {
+    const quint64 formatSize = 4 + 4*4;
+    const quint32 nAttributes = dataOffset + formatSize <= quint64(size) ? header[5] : 0;
+    if (nAttributes == 0 || nAttributes > quint32(MAX_VERTEX_ATTRIBUTES) ||
+        dataOffset + formatSize + nAttributes * 8 > quint64(size)) {
+      data.error = "Invalid vertex format in " + name + "!";
+      return false;
+    }
+
+    const float* position = reinterpret_cast<const float*>(bytes + dataOffset + 4);
+    const uchar* attributes = bytes + dataOffset + formatSize;
+    VertexFormat& format = data.format;
+    format = VertexFormat();
+    format.stride = data.vertexSize;
+    format.positionOffset[0] = position[0];
+    format.positionOffset[1] = position[1];
+    format.positionOffset[2] = position[2];
+    format.positionScale = position[3];
+    for (quint32 i = 0; i < nAttributes; ++i) {
+      const uchar* attribute = attributes + i*8;
+      format.add(attribute[0], attribute[1], attribute[2], attribute[3],
+        *reinterpret_cast<const quint32*>(attribute + 4));
+    }
+    dataOffset += formatSize + nAttributes * 8;
+  }
+
+  // decode reads vertices on the CPU too, an attribute outside the vertex would read
+  // past the file.
+  if (!data.format.isValid()) {
+    data.error = "Invalid vertex format in " + name + "!";
+    return false;
+  }
+
+  if (data.format.usesType(VertexAttribute::Snorm10_10_10_2) && !GLEW_VERSION_3_3 && !GLEW_ARB_vertex_type_2_10_10_10_rev) {
+    data.error = name + " has packed 10_10_10_2 attributes, which this GL can't fetch!";
+    return false;
+  }
+
+  const quint64 vertexBytes = quint64(data.nVertices) * data.vertexSize;
+  const quint64 indexBytes = quint64(data.nIndices) * data.indexSize;
+  if (dataOffset + vertexBytes + indexBytes > quint64(size)) {
+    data.error = "Header of " + name + " does not match the file size!";
+    return false;
+  }
+
+  data.vertexData = reinterpret_cast<const char*>(bytes + dataOffset);
+  data.indexData = data.vertexData + vertexBytes;
+
+  // Fault the pages in here, so a background load doesn't stall the GL thread on disk reads.
+  volatile uchar touched = 0;
+  for (quint64 i = dataOffset; i < dataOffset + vertexBytes + indexBytes; i += 4096)
+    touched += bytes[i];
+
+  computeMeshBounds(data);
+  return true;
+}
+
+// Opens and maps a .mesh file. QFile is a QObject, so this and MeshData::release stay on
+// the GL thread and only parseMeshData goes to the pool.
+bool mapMesh(MeshData& data, const QString& fileName) {
+  // The whole file is mapped and the buffers are filled straight from the mapping,
+  // so the data is never copied into an intermediate heap buffer.
+  data.file = new QFile(fileName);
+  if (!data.file->open(QIODevice::ReadOnly)) {
+    data.error = "Error opening file " + fileName + "!";
+    data.release();
+    return false;
+  }
+
+  data.mappedSize = data.file->size();
+  data.mapped = data.mappedSize >= MESH_HEADER_SIZE ? data.file->map(0, data.mappedSize) : NULL;
+  if (data.mapped == NULL) {
+    data.error = "Error mapping file " + fileName + "!";
+    data.release();
+    return false;
+  }
+  return true;
+}
+
+// The pool's half of requestMesh, data comes mapped (or with the error) from mapMesh.
+MeshData parseMappedMesh(MeshData data, const QString& fileName) {
+  if (data.error.isEmpty())
+    parseMeshData(data, data.mapped, data.mappedSize, fileName);
+  return data;
+}
+
+MeshData parseMesh(const QString& fileName) {
+  MeshData data;
+  if (mapMesh(data, fileName) && !parseMeshData(data, data.mapped, data.mappedSize, fileName))
+    data.release();
+  return data;
+}
+
 class Renderer {
 public:
   Renderer() {
     currentProgram = 0;
+    currentShader = NULL;
+    currentVertexArray = 0;
+    pixelBuffer = 0;
+    frameUniformBuffer = 0;
+    instanceBuffer = 0;
+    instanceRing = NULL;
+    instanceRegionFloats = 0;
+    ringFrame = 0;
+    ringUsed = 0;
+    instanceBase = 0;
+    for (int i = 0; i < INSTANCE_RING_FRAMES; ++i)
+      ringFences[i] = 0;
+    beginFrame();
+    programBinaries = false;
   }
 
   ~Renderer() {
+    // Workers may still be decoding, wait for them before the assets go away.
+    for (int i = 0; i < pendingTextures.size(); ++i)
+      pendingTextures[i].future.waitForFinished();
+    for (int i = 0; i < pendingMeshes.size(); ++i) {
+      MeshData data = pendingMeshes[i].future.result();
+      data.release();
+    }
+
+    if (pixelBuffer != 0)
+      glDeleteBuffers(1, &pixelBuffer);
+    if (frameUniformBuffer != 0)
+      glDeleteBuffers(1, &frameUniformBuffer);
+    deleteInstanceBuffer();
+
     Shader* shader;
     foreach (shader, shaders) {
       glDeleteShader(shader->vertexShader);
@@ -135,6 +809,14 @@ public:
     foreach (mesh, meshes) {
       delete mesh;
     }
+
+    GeometryPool* pool;
+    foreach (pool, geometryPools) {
+      glDeleteVertexArrays(1, &(pool->vao));
+      glDeleteBuffers(1, &(pool->vertexBuffer));
+      glDeleteBuffers(1, &(pool->indexBuffer));
+      delete pool;
+    }
   }
 
   Shader* addShader(const char* fileName) {
@@ -163,6 +845,27 @@ public:
 
     file.close();
 
+    return createShader(doc, fileName, fullPath);
+  }
+
+  Shader* addShader(const Pack& pack, const QString& name) {
+    QString fullPath = pack.path() + name;
+    if (loadedShaders.contains(fullPath))
+      return loadedShaders[fullPath];
+
+    const Pack::Entry* entry = pack.find(name);
+    if (entry == NULL)
+      throw load_exception("Shader " + name + " is not in the pack!");
+
+    QDomDocument doc;
+    QString msg;
+    if (!doc.setContent(pack.bytes(entry), false, &msg))
+      throw load_exception("Error loading shader " + name + " [" + msg + "]");
+
+    return createShader(doc, name, fullPath);
+  }
+
+  Shader* createShader(const QDomDocument& doc, const QString& fileName, const QString& fullPath) {
     QString vertexShaderSource;
     QString pixelShaderSource;
     QDomNodeList shaders = doc.elementsByTagName("shader");
@@ -175,77 +878,77 @@ public:
         pixelShaderSource = e.text();
     }
 
-    GLuint program = glCreateProgram();
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    GLuint pixelShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-    // TODO: yuck, ugly
-    QStringList splitted = vertexShaderSource.split('\n');
-    char** lines = new char*[splitted.size()];
-    for (int i = 0; i < splitted.size(); ++i) {
-      std::string line = splitted[i].toStdString();
-      lines[i] = new char[line.size()+1];
-      strcpy(lines[i], line.c_str());
-    }
-    glShaderSource(vertexShader, splitted.size(), (const GLchar**)(lines), NULL);
-    for (int i = 0; i < splitted.size(); ++i)
-      delete [] lines[i];
-    delete [] lines;
-
-    splitted = pixelShaderSource.split('\n');
-    lines = new char*[splitted.size()];
-    for (int i = 0; i < splitted.size(); ++i) {
-      std::string line = splitted[i].toStdString();
-      lines[i] = new char[line.size()+1];
-      strcpy(lines[i], line.c_str());
-    }
-    glShaderSource(pixelShader, splitted.size(), (const GLchar**)(lines), NULL);
-    for (int i = 0; i < splitted.size(); ++i)
-      delete [] lines[i];
-    delete [] lines;
-
-    glCompileShader(vertexShader);
-    if (!checkSuccess(vertexShader)) {
-      QString error = "Failed to compile vertex shader ";
-      error += fileName;
-      error += "!";
-      throw load_exception(error.toStdString());
-    }
-
-    glCompileShader(pixelShader);
-    if (!checkSuccess(pixelShader)) {
-      QString error = "Failed to compile pixel shader ";
-      error += fileName;
-      error += "!";
-      throw load_exception(error.toStdString());
-    }
-
-    glAttachShader(program, vertexShader);
-    glAttachShader(program, pixelShader);
+    const QByteArray vertexSource = vertexShaderSource.toUtf8();
+    const QByteArray pixelSource = pixelShaderSource.toUtf8();
 
+    QList<QPair<int, QByteArray> > attributes;
     QDomNodeList attrNodes = doc.elementsByTagName("attribute");
     for (uint i = 0; i < attrNodes.length(); ++i) {
       QDomElement e = attrNodes.at(i).toElement();
       if (!e.hasAttribute("unit") || !e.hasAttribute("name")) {
-        std::cout << "Shader " << fileName << " attribute incorrectly specified!" << std::endl; // TODO: make sure toInt didn't fail!
+        std::cout << "Shader " << fileName.toStdString() << " attribute incorrectly specified!" << std::endl; // TODO: make sure toInt didn't fail!
         continue;
       }
-      glBindAttribLocation(program, e.attribute("unit").toInt(), e.attribute("name").toStdString().c_str());
+      attributes << qMakePair(e.attribute("unit").toInt(), e.attribute("name").toUtf8());
     }
 
-    glLinkProgram(program);
-
     Shader* shader = new Shader;
-    shader->program = program;
-    shader->vertexShader = vertexShader;
-    shader->pixelShader = pixelShader;
+    shader->name = fileName;
+    shader->program = glCreateProgram();
+    shader->vertexShader = 0;
+    shader->pixelShader = 0;
+    shader->pending = false;
+    shader->instanced = false;
+    shader->textureArrays = false;
     this->shaders << shader;
+    loadedShaders[fullPath] = shader;
+
+    initProgramCache();
+    if (programBinaries) {
+      // Anything that changes the linked program has to be part of the key.
+      QCryptographicHash hash(QCryptographicHash::Sha1);
+      hash.addData(driverId);
+      hash.addData(vertexSource);
+      hash.addData("\0", 1);
+      hash.addData(pixelSource);
+      for (int i = 0; i < attributes.size(); ++i) {
+        hash.addData("\0", 1);
+        hash.addData(QByteArray::number(attributes[i].first) + "=" + attributes[i].second);
+      }
+      shader->cacheKey = hash.result().toHex();
+
+      if (loadProgramBinary(shader)) {
+        reflectUniforms(shader);
+        std::cout << "Loaded shader " << fullPath.toStdString() << " from the program cache" << std::endl;
+        return shader;
+      }
+    }
+
+    shader->vertexShader = compileStage(GL_VERTEX_SHADER, vertexSource);
+    shader->pixelShader = compileStage(GL_FRAGMENT_SHADER, pixelSource);
+    glAttachShader(shader->program, shader->vertexShader);
+    glAttachShader(shader->program, shader->pixelShader);
+    for (int i = 0; i < attributes.size(); ++i)
+      glBindAttribLocation(shader->program, attributes[i].first, attributes[i].second.constData());
+    if (!shader->cacheKey.isEmpty())
+      glProgramParameteri(shader->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(shader->program);
+
+    // Querying the status would wait for the compiler, so that's left to finishShaders.
+    shader->pending = true;
+    pendingShaders << shader;
 
     std::cout << "Loaded shader " << fullPath.toStdString() << std::endl;
-    loadedShaders[fullPath] = shader;
     return shader;
   }
 
+  // Waits for all shaders that are still compiling, throws load_exception for the first
+  // that failed to compile or link. Call once after loading, before drawing.
+  void finishShaders() {
+    while (!pendingShaders.isEmpty())
+      finishShader(pendingShaders.first());
+  }
+
   VertexBuffer* addVertexBuffer(const char* data, unsigned int sizeInBytes, GLenum hint) {
     GLuint id;
     glGenBuffers(1, &id);
@@ -262,83 +965,145 @@ public:
   Texture* addTexture(const char* fileName) { // TODO: more params!
     QString fullPath = QFileInfo(fileName).absoluteFilePath();
     if (loadedTextures.contains(fullPath))
-      return loadedTextures[fullPath];
+      return handOut(loadedTextures[fullPath]);
 
-    GLuint id;
-    QImage img;
-    QImage glImg;
+    DecodedImage decoded = decodeImage(fileName);
+    if (!decoded.error.isEmpty())
+      throw load_exception(decoded.error);
 
-    if (!img.load(fileName)) {
-      QString error = "Error opening ";
-      error += fileName;
-      throw load_exception(error);
-    }
+    Texture* texture = new Texture;
+    glGenTextures(1, &(texture->id));
+    uploadDecodedTexture(texture, decoded, false);
+    textures << texture;
 
-    glImg = QGLWidget::convertToGLFormat(img);
-    if(glImg.isNull()) {
-      QString error = "Error converting ";
-      error += fileName;
-      error += " to a format OpenGL prefers!";
-      throw load_exception(error);
-    }
+    loadedTextures[fullPath] = texture;
+    std::cout << "Loaded texture " << fileName << std::endl;
+    return handOut(texture);
+  }
 
-    glGenTextures(1, &id);
-    glBindTexture(GL_TEXTURE_2D, id);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-            glImg.width(), glImg.height(),
-            0, GL_RGBA, GL_UNSIGNED_BYTE, glImg.bits());
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    /*float maximumAnisotropy;
-    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maximumAnisotropy);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maximumAnisotropy);*/
+  // Texture entries are uploaded straight from the mapping, image entries still need decoding.
+  Texture* addTexture(const Pack& pack, const QString& name) {
+    QString fullPath = pack.path() + name;
+    if (loadedTextures.contains(fullPath))
+      return handOut(loadedTextures[fullPath]);
+
+    const Pack::Entry* entry = pack.find(name);
+    if (entry == NULL)
+      throw load_exception("Texture " + name + " is not in the pack!");
 
     Texture* texture = new Texture;
-    texture->id = id;
-    texture->height = glImg.height();
-    texture->width = glImg.width();
+    if (entry->type == Pack::Texture) {
+      const quint32* size = reinterpret_cast<const quint32*>(pack.data(entry));
+      if (entry->size < 8 || entry->size - 8 < quint64(size[0]) * size[1] * 4) {
+        delete texture;
+        throw load_exception("Texture " + name + " in the pack is truncated!");
+      }
+      glGenTextures(1, &(texture->id));
+      uploadTexture(texture, size[0], size[1], pack.data(entry) + 8, false);
+    }
+    else if (entry->type == Pack::Dds) {
+      DecodedImage decoded;
+      if (!parseDds(pack.bytes(entry), name, decoded)) {
+        delete texture;
+        throw load_exception(decoded.error);
+      }
+      glGenTextures(1, &(texture->id));
+      uploadDecodedTexture(texture, decoded, false);
+    }
+    else {
+      QImage img;
+      QImage glImg;
+      if (!img.loadFromData(pack.bytes(entry)) || (glImg = QGLWidget::convertToGLFormat(img)).isNull()) {
+        delete texture;
+        throw load_exception("Error decoding " + name + " from the pack!");
+      }
+      glGenTextures(1, &(texture->id));
+      uploadTexture(texture, glImg.width(), glImg.height(), glImg.bits(), false);
+    }
     textures << texture;
 
     loadedTextures[fullPath] = texture;
-    std::cout << "Loaded texture " << fileName << std::endl;
-    return texture;
+    std::cout << "Loaded texture " << name.toStdString() << " from pack" << std::endl;
+    return handOut(texture);
+  }
+
+  // Returns at once with a 1x1 grey placeholder, the image is decoded on the global thread
+  // pool and uploaded into the same texture by processLoadedAssets.
+  Texture* requestTexture(const char* fileName, AssetListener* listener = NULL) {
+    QString fullPath = QFileInfo(fileName).absoluteFilePath();
+    if (loadedTextures.contains(fullPath)) {
+      Texture* texture = loadedTextures[fullPath];
+      for (int i = 0; i < pendingTextures.size(); ++i) {
+        if (pendingTextures[i].texture == texture)
+          addListener(pendingTextures[i].listeners, listener);
+      }
+      return handOut(texture);
+    }
+
+    const GLubyte grey[4] = {128, 128, 128, 255};
+    Texture* texture = new Texture;
+    glGenTextures(1, &(texture->id));
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    textureBound(texture->id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    texture->width = texture->height = 1;
+    textures << texture;
+    loadedTextures[fullPath] = texture;
+
+    PendingTexture pending;
+    pending.texture = texture;
+    pending.fileName = fileName;
+    pending.future = QtConcurrent::run(decodeImage, QString(fileName));
+    addListener(pending.listeners, listener);
+    pendingTextures << pending;
+    return handOut(texture);
   }
 
   Texture* addCubemap(const char** filenames) {
     GLuint id;
     glGenTextures(1, &id);
     glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    textureBound(id);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
+    // Mipmaps are only used when every face comes with a precomputed chain. A cube map is
+    // incomplete unless all faces share one format, so .dds and plain images can't be mixed.
+    int levels = 0;
+    GLenum format = 0;
     for (int i = 0; i < 6; ++i) {
-      QImage img;
-      QImage glImg;
-
-      if (!img.load(filenames[i])) {
-        QString error = "Error opening ";
-        error += filenames[i];
-        throw load_exception(error);
+      DecodedImage decoded = decodeImage(filenames[i]);
+      if (!decoded.error.isEmpty())
+        throw load_exception(decoded.error);
+      if (i > 0 && decoded.compressedFormat != format) {
+        glDeleteTextures(1, &id);
+        throw load_exception(std::string("Cubemap face ") + filenames[i] + " has another format than the first face!");
       }
+      format = decoded.compressedFormat;
 
-      glImg = QGLWidget::convertToGLFormat(img);
-      if(glImg.isNull()) {
-        QString error = "Error converting ";
-        error += filenames[i];
-        error += " to a format OpenGL prefers!";
-        throw load_exception(error);
+      if (!decoded.compressed.isEmpty()) {
+        uploadCompressedTexture(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, decoded);
+        levels = i == 0 ? decoded.levels : qMin(levels, decoded.levels);
+      }
+      else {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, decoded.image.width(), decoded.image.height(), 0, GL_RGBA,
+          GL_UNSIGNED_BYTE, decoded.image.bits());
+        levels = 1;
       }
-
-      glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, glImg.width(), glImg.height(), 0, GL_RGBA,
-        GL_UNSIGNED_BYTE, glImg.bits());
     }
 
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    if (levels > 1)
+      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
     Texture* cubemap = new Texture;
     cubemap->id = id;
+    cubemap->target = GL_TEXTURE_CUBE_MAP;
     // TODO: width/height?
     textures << cubemap;
     std::cout << "Loaded cubemap with first texture " << filenames[0] << std::endl;
@@ -346,6 +1111,7 @@ public:
   }
 
   IndexBuffer* addIndexBuffer(const char* data, unsigned int sizeInBytes, GLenum hint) {
+    bindVertexArray(0); // Don't replace the index buffer of a geometry pool.
     GLuint id;
     glGenBuffers(1, &id);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
@@ -358,65 +1124,282 @@ public:
     return buffer;
   }
 
+  void setTexture(UniformId sampler, Texture* texture, unsigned int unit) {
+    bindTexture(unit, texture->id, texture->target);
+    setSampler(sampler, unit);
+  }
+
   void setTexture(const char* samplerName, Texture* texture, unsigned int unit) {
-    glActiveTexture(GL_TEXTURE0 + unit);
-    glBindTexture(GL_TEXTURE_2D, texture->id);
-    if (currentProgram != 0)
-      glUniform1i(glGetUniformLocation(currentProgram, samplerName), unit);
+    setTexture(uniformId(samplerName), texture, unit);
   }
 
-  void setShader(Shader* shader) {
-    if (shader != currentShader && shader != NULL) {
-      glUseProgram(shader->program);
-      currentProgram = shader->program;
-      currentShader = shader;
+  // Points a sampler of the current shader at a texture unit. Uniform values are part of
+  // the program, so each shader remembers what its samplers were last set to.
+  void setSampler(UniformId sampler, unsigned int unit) {
+    if (currentShader == NULL)
+      return;
+    QVector<GLint>& units = currentShader->samplerUnits;
+    if (sampler < units.size() && units[sampler] == GLint(unit)) {
+      ++counters.skipped;
+      return;
     }
+    while (units.size() <= sampler)
+      units << -1;
+    units[sampler] = unit;
+    glUniform1i(uniformLocation(sampler), unit);
+    ++counters.issued;
   }
 
-  Shader* getCurrentShader() const {
-    return currentShader;
+  // A NULL shader leaves the current program bound, it is neither issued nor skipped.
+  void setShader(Shader* shader) {
+    if (shader == currentShader) {
+      ++counters.skipped;
+      return;
+    }
+    if (shader == NULL)
+      return;
+
+    if (shader->pending)
+      finishShader(shader);
+    glUseProgram(shader->program);
+    currentProgram = shader->program;
+    currentShader = shader;
+    ++counters.issued;
   }
 
-  void disableShaders() {
-    glUseProgram(0);
-    currentProgram = 0;
-    currentShader = NULL; // TODO: nullptr?
+  // State changes that go through the Renderer are compared against what it last set and
+  // skipped when nothing changes. Code that calls GL directly (Qt's renderText, the fixed
+  // function HUD) leaves the shadowed state stale, so it is forgotten at the start of
+  // every frame and whenever invalidateState is called.
+  struct StateCounters {
+    int issued;
+    int skipped;
+  };
+
+  void beginFrame() {
+    invalidateState();
+    counters.issued = 0;
+    counters.skipped = 0;
+    advanceInstanceRing();
   }
 
-  void setUniform1i(const char* name, int value) {
-    glUniform1i(glGetUniformLocation(currentProgram, name), value);
+  const StateCounters& stateCounters() const {
+    return counters;
   }
 
-  void setUniform1d(const char* name, double value) {
-    glUniform1f(glGetUniformLocation(currentProgram, name), value);
+  void invalidateState() {
+    activeTextureUnit = UNKNOWN_STATE;
+    for (unsigned int i = 0; i < MAX_TRACKED_TEXTURE_UNITS; ++i)
+      boundTextures[i] = UNKNOWN_STATE;
+    for (int i = 0; i < TRACKED_CAPABILITIES; ++i)
+      capabilities[i] = UNKNOWN_STATE;
+    alphaFunc = blendSource = blendDestination = depthFunc = depthMask = colorMask = UNKNOWN_STATE;
   }
 
-  void setUniform1f(const char* name, float value) {
-    glUniform1f(glGetUniformLocation(currentProgram, name), value);
+  void setActiveTextureUnit(unsigned int unit) {
+    if (unit == activeTextureUnit) {
+      ++counters.skipped;
+      return;
+    }
+    glActiveTexture(GL_TEXTURE0 + unit);
+    activeTextureUnit = unit;
+    ++counters.issued;
   }
 
-  void setUniform2f(const char* name, const vec2& value) {
-    glUniform2f(glGetUniformLocation(currentProgram, name), value.x(), value.y());
+  // Only the last id bound to a unit is tracked, whatever the target. Texture names are
+  // unique across targets, so this never skips a bind that is needed.
+  void bindTexture(unsigned int unit, GLuint id, GLenum target = GL_TEXTURE_2D) {
+    if (unit < MAX_TRACKED_TEXTURE_UNITS && boundTextures[unit] == id) {
+      ++counters.skipped;
+      return;
+    }
+    setActiveTextureUnit(unit);
+    glBindTexture(target, id);
+    if (unit < MAX_TRACKED_TEXTURE_UNITS)
+      boundTextures[unit] = id;
+    ++counters.issued;
   }
 
-  void setUniform3f(const char* name, const vec3& value) {
-    glUniform3f(glGetUniformLocation(currentProgram, name), value.x(), value.y(), value.z());
+  // Only GL_BLEND, GL_ALPHA_TEST and GL_DEPTH_TEST are tracked, others are always set.
+  void setCapability(GLenum capability, bool enabled) {
+    int index = -1;
+    switch (capability) {
+      case GL_BLEND:      index = 0; break;
+      case GL_ALPHA_TEST: index = 1; break;
+      case GL_DEPTH_TEST: index = 2; break;
+    }
+    if (index >= 0 && capabilities[index] == GLuint(enabled)) {
+      ++counters.skipped;
+      return;
+    }
+    if (enabled)
+      glEnable(capability);
+    else
+      glDisable(capability);
+    if (index >= 0)
+      capabilities[index] = enabled;
+    ++counters.issued;
   }
 
-  void setUniform4f(const char* name, const vec4& value) {
-    glUniform4f(glGetUniformLocation(currentProgram, name), value.x(), value.y(), value.z(), value.w());
+  // The reference value isn't tracked, callers in this code always pair a function with
+  // the same one.
+  void setAlphaFunc(GLenum func, GLclampf reference) {
+    if (func == alphaFunc) {
+      ++counters.skipped;
+      return;
+    }
+    glAlphaFunc(func, reference);
+    alphaFunc = func;
+    ++counters.issued;
+  }
+
+  void setBlendFunc(GLenum source, GLenum destination) {
+    if (source == blendSource && destination == blendDestination) {
+      ++counters.skipped;
+      return;
+    }
+    glBlendFunc(source, destination);
+    blendSource = source;
+    blendDestination = destination;
+    ++counters.issued;
+  }
+
+  void setDepthFunc(GLenum func) {
+    if (func == depthFunc) {
+      ++counters.skipped;
+      return;
+    }
+    glDepthFunc(func);
+    depthFunc = func;
+    ++counters.issued;
+  }
+
+  void setDepthMask(bool write) {
+    if (GLuint(write) == depthMask) {
+      ++counters.skipped;
+      return;
+    }
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+    depthMask = write;
+    ++counters.issued;
+  }
+
+  // All four channels at once.
+  void setColorMask(bool write) {
+    if (GLuint(write) == colorMask) {
+      ++counters.skipped;
+      return;
+    }
+    const GLboolean mask = write ? GL_TRUE : GL_FALSE;
+    glColorMask(mask, mask, mask, mask);
+    colorMask = write;
+    ++counters.issued;
+  }
+
+  Shader* getCurrentShader() const {
+    return currentShader;
+  }
+
+  void disableShaders() {
+    glUseProgram(0);
+    currentProgram = 0;
+    currentShader = NULL; // TODO: nullptr?
+    bindVertexArray(0); // Fixed function code that follows must not touch a pool's vao.
+  }
+
+  // Uniform names are interned once, every shader maps the ids to its own locations when
+  // it is linked. Setting a uniform by id is then an array lookup instead of a string
+  // lookup in the driver. The const char* setters intern on every call, keep them for
+  // code that doesn't run per object.
+  static UniformId uniformId(const char* name) {
+    static QHash<QByteArray, UniformId> ids;
+    const QByteArray key(name);
+    UniformId id = ids.value(key, -1);
+    if (id < 0) {
+      id = ids.size();
+      ids.insert(key, id);
+    }
+    return id;
+  }
+
+  GLint uniformLocation(UniformId id) const {
+    if (currentShader == NULL || id >= currentShader->uniformLocations.size())
+      return -1;
+    return currentShader->uniformLocations[id];
+  }
+
+  // Uploads the constants to the buffer every program's Frame block is bound to. The old
+  // contents are orphaned, so this doesn't wait for draws still reading last frame's.
+  void setFrameConstants(const FrameConstants& constants) {
+    if (frameUniformBuffer == 0)
+      glGenBuffers(1, &frameUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameConstants), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameConstants), &constants);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, frameUniformBuffer);
+  }
+
+  void setUniform1i(UniformId id, int value) {
+    if (currentShader != NULL && id < currentShader->samplerUnits.size())
+      currentShader->samplerUnits[id] = value; // Keep setSampler in sync.
+    glUniform1i(uniformLocation(id), value);
+  }
+
+  void setUniform1f(UniformId id, float value) {
+    glUniform1f(uniformLocation(id), value);
+  }
+
+  void setUniform2f(UniformId id, const vec2& value) {
+    glUniform2f(uniformLocation(id), value.x(), value.y());
+  }
+
+  void setUniform3f(UniformId id, const vec3& value) {
+    glUniform3f(uniformLocation(id), value.x(), value.y(), value.z());
+  }
+
+  void setUniform4f(UniformId id, const vec4& value) {
+    glUniform4f(uniformLocation(id), value.x(), value.y(), value.z(), value.w());
+  }
+
+  void setUniformMat4(UniformId id, const mat4& value) {
+    glUniformMatrix4fv(uniformLocation(id), 1, GL_FALSE, value.constData());
+  }
+
+  void setUniform4fv(UniformId id, const GLfloat* value) {
+    glUniformMatrix4fv(uniformLocation(id), 1, GL_FALSE, value);
+  }
+
+  void setUniform1i(const char* name, int value) {
+    setUniform1i(uniformId(name), value);
+  }
+
+  void setUniform1d(const char* name, double value) {
+    setUniform1f(uniformId(name), value);
+  }
+
+  void setUniform1f(const char* name, float value) {
+    setUniform1f(uniformId(name), value);
+  }
+
+  void setUniform2f(const char* name, const vec2& value) {
+    setUniform2f(uniformId(name), value);
+  }
+
+  void setUniform3f(const char* name, const vec3& value) {
+    setUniform3f(uniformId(name), value);
+  }
+
+  void setUniform4f(const char* name, const vec4& value) {
+    setUniform4f(uniformId(name), value);
   }
 
   void setUniformMat4(const char* name, const mat4& value) {
-    GLfloat mat[4*4];
-    const qreal* data = value.constData();
-    for (int i = 0; i < 16; ++i)
-      mat[i] = data[i];
-    glUniformMatrix4fv(glGetUniformLocation(currentProgram, name), 1, GL_FALSE, mat);
+    setUniformMat4(uniformId(name), value);
   }
 
   void setUniform4fv(const char* name, const GLfloat* value) {
-    glUniformMatrix4fv(glGetUniformLocation(currentProgram, name), 1, GL_FALSE, value);
+    setUniform4fv(uniformId(name), value);
   }
 
   void drawGrid(uint numOfLines, float halfSize) {
@@ -433,134 +1416,977 @@ public:
   }
 
   Mesh* addMesh(const char* fileName) {
-    // Format:
-    // format version     |
-    // nVertices          |
-    // nIndices           |  4 bytes each
-    // vertexSize         |
-    // indexSize          |
-    // vertexBuffer (nVertices * vertexSize)
-    // indexBuffer (nIndices * indexSize)
-
     QString fullPath = QFileInfo(fileName).absoluteFilePath();
     if (loadedMeshes.contains(fullPath))
       return loadedMeshes[fullPath];
 
-    std::ifstream file;
-    file.open(fileName, std::ios::binary);
+    MeshData data = parseMesh(fileName);
+    if (!data.error.isEmpty())
+      throw load_exception(data.error);
 
-    if (!file.is_open()) {
-      QString error = "Error opening file ";
-      error += fileName;
-      error += "!";
+    Mesh* mesh = new Mesh;
+    uploadMesh(data, mesh);
+    meshes << mesh;
+
+    loadedMeshes[fullPath] = mesh;
+    std::cout << "Loaded mesh " << fileName <<  std::endl;
+    return mesh;
+  }
+
+  Mesh* addMesh(const Pack& pack, const QString& name) {
+    QString fullPath = pack.path() + name;
+    if (loadedMeshes.contains(fullPath))
+      return loadedMeshes[fullPath];
+
+    const Pack::Entry* entry = pack.find(name);
+    if (entry == NULL)
+      throw load_exception("Mesh " + name + " is not in the pack!");
+
+    MeshData data;
+    if (!parseMeshData(data, pack.data(entry), entry->size, name))
+      throw load_exception(data.error);
+
+    Mesh* mesh = new Mesh;
+    uploadMesh(data, mesh);
+    meshes << mesh;
+
+    loadedMeshes[fullPath] = mesh;
+    std::cout << "Loaded mesh " << name.toStdString() << " from pack" << std::endl;
+    return mesh;
+  }
+
+  // Like addMesh, but the mapped file is validated on the global thread pool. The returned
+  // mesh draws nothing until processLoadedAssets uploads it, errors are reported there.
+  Mesh* requestMesh(const char* fileName, AssetListener* listener = NULL) {
+    QString fullPath = QFileInfo(fileName).absoluteFilePath();
+    if (loadedMeshes.contains(fullPath)) {
+      Mesh* mesh = loadedMeshes[fullPath];
+      for (int i = 0; i < pendingMeshes.size(); ++i) {
+        if (pendingMeshes[i].mesh == mesh)
+          addListener(pendingMeshes[i].listeners, listener);
+      }
+      return mesh;
+    }
+
+    Mesh* mesh = new Mesh;
+    meshes << mesh;
+    loadedMeshes[fullPath] = mesh;
+
+    PendingMesh pending;
+    pending.mesh = mesh;
+    pending.fileName = fileName;
+    MeshData data;
+    mapMesh(data, fileName); // Errors travel through the job to processLoadedAssets.
+    pending.future = QtConcurrent::run(parseMappedMesh, data, QString(fileName));
+    addListener(pending.listeners, listener);
+    pendingMeshes << pending;
+    return mesh;
+  }
+
+  // Bakes loaded meshes with the same attributes into one new mesh, each part moved by its
+  // rigid transform. The vertices are read back from the geometry pools, decoded, moved and
+  // encoded again in the layout of the parts. Quantized positions get the merged bounds.
+  Mesh* mergeMeshes(const QVector<const Mesh*>& parts, const QVector<btTransform>& transforms) {
+    const VertexFormat& partFormat = parts.first()->format;
+    int floatsPerVertex = 0;
+    for (int a = 0; a < partFormat.nAttributes; ++a)
+      floatsPerVertex += partFormat.attributes[a].components;
+
+    unsigned int nVertices = 0, nIndices = 0;
+    for (int i = 0; i < parts.size(); ++i) {
+      nVertices += parts[i]->nVertices;
+      nIndices += parts[i]->nIndices;
+    }
+
+    MeshData data;
+    data.version = 4;
+    data.nVertices = nVertices;
+    data.nIndices = nIndices;
+    data.vertexSize = partFormat.stride;
+    data.indexSize = nVertices <= 0x10000 ? 2 : 4;
+    QVector<float> decoded(nVertices * floatsPerVertex);
+    QByteArray indices(nIndices * data.indexSize, 0);
+
+    btVector3& aabbMin = data.aabbMin;
+    btVector3& aabbMax = data.aabbMax;
+    aabbMin.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+    aabbMax.setValue(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+
+    float* out = decoded.data();
+    unsigned int firstVertex = 0, firstIndex = 0;
+    for (int i = 0; i < parts.size(); ++i) {
+      const Mesh* part = parts[i];
+      const btTransform& transform = transforms[i];
+      QByteArray partVertices(part->nVertices * part->vertexSize, 0);
+      QByteArray partIndices(part->nIndices * part->indexSize, 0);
+
+      // The copy target leaves the array and element bindings of the vertex arrays alone.
+      glBindBuffer(GL_COPY_READ_BUFFER, part->pool->vertexBuffer);
+      glGetBufferSubData(GL_COPY_READ_BUFFER, part->baseVertex * part->vertexSize, partVertices.size(), partVertices.data());
+      glBindBuffer(GL_COPY_READ_BUFFER, part->pool->indexBuffer);
+      glGetBufferSubData(GL_COPY_READ_BUFFER, part->firstIndex * part->indexSize, partIndices.size(), partIndices.data());
+
+      for (unsigned int v = 0; v < part->nVertices; ++v) {
+        const char* vertex = partVertices.constData() + v * part->vertexSize;
+        for (int a = 0; a < partFormat.nAttributes; ++a) {
+          const VertexAttribute& attribute = part->format.attributes[a];
+          attribute.decode(vertex, out);
+          if (attribute.semantic == VertexAttribute::Position) {
+            const float scale = part->format.positionScale;
+            const float* decodeOffset = part->format.positionOffset;
+            const btVector3 position = transform * btVector3(decodeOffset[0] + scale * out[0],
+              decodeOffset[1] + scale * out[1], decodeOffset[2] + scale * out[2]);
+            out[0] = position.x();
+            out[1] = position.y();
+            out[2] = position.z();
+            aabbMin.setMin(position);
+            aabbMax.setMax(position);
+          }
+          else if (attribute.semantic == VertexAttribute::Normal) {
+            const btVector3 normal = transform.getBasis() * btVector3(out[0], out[1], out[2]);
+            out[0] = normal.x();
+            out[1] = normal.y();
+            out[2] = normal.z();
+          }
+          out += attribute.components;
+        }
+      }
+
+      for (unsigned int n = 0; n < part->nIndices; ++n) {
+        quint32 index;
+        if (part->indexSize == 2)
+          index = reinterpret_cast<const quint16*>(partIndices.constData())[n];
+        else
+          index = reinterpret_cast<const quint32*>(partIndices.constData())[n];
+        index += firstVertex;
+        if (data.indexSize == 2)
+          reinterpret_cast<quint16*>(indices.data())[firstIndex + n] = index;
+        else
+          reinterpret_cast<quint32*>(indices.data())[firstIndex + n] = index;
+      }
+
+      firstVertex += part->nVertices;
+      firstIndex += part->nIndices;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    VertexFormat& format = data.format;
+    format = partFormat;
+    format.positionOffset[0] = format.positionOffset[1] = format.positionOffset[2] = 0;
+    format.positionScale = 1;
+    for (int a = 0; a < format.nAttributes; ++a) {
+      const VertexAttribute& attribute = format.attributes[a];
+      if (attribute.semantic == VertexAttribute::Position && attribute.type != VertexAttribute::Float32) {
+        const btVector3 center = (aabbMin + aabbMax) * 0.5;
+        const btVector3 halfExtent = (aabbMax - aabbMin) * 0.5;
+        const btScalar scale = halfExtent[halfExtent.maxAxis()];
+        format.positionOffset[0] = center.x();
+        format.positionOffset[1] = center.y();
+        format.positionOffset[2] = center.z();
+        format.positionScale = scale > 0 ? scale : 1;
+      }
+    }
+
+    QByteArray vertices(nVertices * format.stride, 0);
+    const float* in = decoded.constData();
+    for (unsigned int v = 0; v < nVertices; ++v) {
+      char* vertex = vertices.data() + v * format.stride;
+      for (int a = 0; a < format.nAttributes; ++a) {
+        const VertexAttribute& attribute = format.attributes[a];
+        if (attribute.semantic == VertexAttribute::Position) {
+          float position[4];
+          for (int c = 0; c < attribute.components; ++c)
+            position[c] = c < 3 ? (in[c] - format.positionOffset[c]) / format.positionScale : in[c];
+          attribute.encode(position, vertex);
+        }
+        else
+          attribute.encode(in, vertex);
+        in += attribute.components;
+      }
+    }
+
+    data.vertexData = vertices.constData();
+    data.indexData = indices.constData();
+    Mesh* mesh = new Mesh;
+    uploadMesh(data, mesh);
+    meshes << mesh;
+    return mesh;
+  }
+
+  // The cube from -1 to 1 on every axis, positions only. Scaled and moved it stands in
+  // for any axis aligned box, e.g. as an occlusion query proxy.
+  Mesh* createBoxMesh() {
+    static const float vertices[8 * 3] = {
+      -1, -1, -1,   1, -1, -1,   1,  1, -1,  -1,  1, -1,
+      -1, -1,  1,   1, -1,  1,   1,  1,  1,  -1,  1,  1};
+    static const quint16 indices[36] = {
+      0, 2, 1, 0, 3, 2,  4, 5, 6, 4, 6, 7,  0, 1, 5, 0, 5, 4,
+      1, 2, 6, 1, 6, 5,  2, 3, 7, 2, 7, 6,  3, 0, 4, 3, 4, 7};
+
+    MeshData data;
+    data.version = 4;
+    data.format.add(VertexAttribute::Position, 3, VertexAttribute::Float32, false, 0);
+    data.format.stride = 3 * sizeof(float);
+    data.nVertices = 8;
+    data.nIndices = 36;
+    data.vertexSize = data.format.stride;
+    data.indexSize = 2;
+    data.vertexData = reinterpret_cast<const char*>(vertices);
+    data.indexData = reinterpret_cast<const char*>(indices);
+    data.aabbMin.setValue(-1, -1, -1);
+    data.aabbMax.setValue(1, 1, 1);
+    Mesh* mesh = new Mesh;
+    uploadMesh(data, mesh);
+    meshes << mesh;
+    return mesh;
+  }
+
+  // Uploads requested textures and meshes whose decoding has finished and notifies their
+  // listeners. Call once per frame on the GL thread, maxUploads bounds the work per call.
+  void processLoadedAssets(int maxUploads = 4) {
+    int uploads = 0;
+    AssetListener* listener;
+
+    for (int i = 0; i < pendingTextures.size() && uploads < maxUploads; ) {
+      if (!pendingTextures[i].future.isFinished()) {
+        ++i;
+        continue;
+      }
+
+      PendingTexture pending = pendingTextures.takeAt(i);
+      DecodedImage decoded = pending.future.result();
+      if (!decoded.error.isEmpty()) {
+        assetFailed(pending.listeners, pending.fileName, decoded.error);
+        continue;
+      }
+
+      uploadDecodedTexture(pending.texture, decoded, true);
+      std::cout << "Loaded texture " << pending.fileName.toStdString() << std::endl;
+      foreach (listener, pending.listeners)
+        listener->textureLoaded(pending.texture);
+      ++uploads;
+    }
+
+    for (int i = 0; i < pendingMeshes.size() && uploads < maxUploads; ) {
+      if (!pendingMeshes[i].future.isFinished()) {
+        ++i;
+        continue;
+      }
+
+      PendingMesh pending = pendingMeshes.takeAt(i);
+      MeshData data = pending.future.result();
+      if (!data.error.isEmpty()) {
+        data.release();
+        assetFailed(pending.listeners, pending.fileName, data.error);
+        continue;
+      }
+
+      uploadMesh(data, pending.mesh);
+      std::cout << "Loaded mesh " << pending.fileName.toStdString() << std::endl;
+      foreach (listener, pending.listeners)
+        listener->meshLoaded(pending.mesh);
+      ++uploads;
+    }
+
+    if (pendingAssets() == 0 && !waitingListeners.isEmpty()) {
+      QList<AssetListener*> listeners = waitingListeners;
+      waitingListeners.clear();
+      foreach (listener, listeners)
+        listener->assetsLoaded();
+    }
+  }
+
+  int pendingAssets() const {
+    return pendingTextures.size() + pendingMeshes.size();
+  }
+
+  // Must be called before a listener with outstanding requests is destroyed.
+  void removeAssetListener(AssetListener* listener) {
+    waitingListeners.removeAll(listener);
+    for (int i = 0; i < pendingTextures.size(); ++i)
+      pendingTextures[i].listeners.removeAll(listener);
+    for (int i = 0; i < pendingMeshes.size(); ++i)
+      pendingMeshes[i].listeners.removeAll(listener);
+  }
+
+  // Whether the listener still waits for requested assets, assetsLoaded follows if it does.
+  bool isWaiting(AssetListener* listener) const {
+    return waitingListeners.contains(listener);
+  }
+
+  // Copies textures of the same size and format into 2D texture arrays, so draws that only
+  // differ in them can share one binding. Each texture keeps its own image and learns its
+  // array and layer, textures that match no other get an array of their own.
+  void buildTextureArrays(const QList<Texture*>& sources) {
+    QMap<QByteArray, QList<Texture*> > groups;
+    Texture* texture;
+    foreach (texture, sources) {
+      if (texture->array != NULL || texture->target != GL_TEXTURE_2D)
+        continue;
+      const quint32 key[4] = {texture->width, texture->height, texture->internalFormat, quint32(texture->levels)};
+      QList<Texture*>& group = groups[QByteArray(reinterpret_cast<const char*>(key), sizeof(key))];
+      if (!group.contains(texture))
+        group << texture;
+    }
+
+    GLint maxLayers = 256;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    int nArrays = 0;
+    for (QMap<QByteArray, QList<Texture*> >::const_iterator group = groups.constBegin(); group != groups.constEnd(); ++group) {
+      const QList<Texture*>& members = group.value();
+      for (int first = 0; first < members.size(); first += maxLayers) {
+        const int layers = qMin(members.size() - first, int(maxLayers));
+        Texture* array = createTextureArray(members[first], layers);
+        for (int layer = 0; layer < layers; ++layer)
+          copyToLayer(members[first + layer], array, layer);
+        ++nArrays;
+      }
+    }
+    if (nArrays > 0)
+      std::cout << "Packed " << sources.size() << " textures into " << nArrays << " texture arrays" << std::endl;
+  }
+
+  // Frees the images of textures that are only sampled through their texture array. The
+  // caller vouches for its own uses, textures somebody else asked for too are kept.
+  void releaseArraySources(const QList<Texture*>& textures) {
+    int released = 0;
+    Texture* texture;
+    foreach (texture, textures) {
+      if (texture->array == NULL || texture->id == 0 || texture->users > 1)
+        continue;
+      for (unsigned int i = 0; i < MAX_TRACKED_TEXTURE_UNITS; ++i) {
+        if (boundTextures[i] == texture->id)
+          boundTextures[i] = UNKNOWN_STATE; // Deleting unbinds it, the id may come back.
+      }
+      glDeleteTextures(1, &(texture->id));
+      texture->id = 0;
+      ++released;
+    }
+    if (released > 0)
+      std::cout << "Released " << released << " textures that live on in texture arrays" << std::endl;
+  }
+
+  // Whether the shader takes per instance transforms (see drawMeshInstanced) instead of the
+  // modelView and model uniforms.
+  bool isInstanced(Shader* shader) {
+    if (shader->pending)
+      finishShader(shader);
+    return shader->instanced;
+  }
+
+  // Whether texture0 of the shader has to be a texture array, see buildTextureArrays.
+  bool usesTextureArrays(Shader* shader) {
+    if (shader->pending)
+      finishShader(shader);
+    return shader->textureArrays;
+  }
+
+  // Room for the data of count instances (INSTANCE_FLOATS each) for the next instanced
+  // draws: a column major model matrix, then the layer of texture0 in its array. Fill it
+  // front to back without reading it (it may be write combined memory), then call
+  // commitInstanceData. The block is only valid until the next call, which may orphan or
+  // rebuild the buffer, so issue its draws before asking for more.
+  GLfloat* allocateInstanceData(int count) {
+    const unsigned int floats = count * INSTANCE_FLOATS;
+    if (instanceRing == NULL) {
+      instanceStaging.resize(floats);
+      return instanceStaging.data();
+    }
+
+    if (ringUsed + floats > instanceRegionFloats) {
+      // Rare, the ring is rebuilt big enough for a few frames like this one.
+      deleteInstanceBuffer();
+      createInstanceBuffer(2 * (ringUsed + floats));
+    }
+    if (ringUsed == 0)
+      waitForRegion(ringFrame);
+
+    const unsigned int offset = ringFrame * instanceRegionFloats + ringUsed;
+    instanceBase = offset / INSTANCE_FLOATS;
+    ringUsed += floats;
+    return instanceRing + offset;
+  }
+
+  void commitInstanceData() {
+    if (instanceRing != NULL || instanceStaging.isEmpty())
+      return; // Persistent mappings are coherent, the GPU sees the writes as they are.
+
+    instanceBase = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, instanceStaging.size() * sizeof(GLfloat), instanceStaging.constData(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  // Draws count copies of the mesh, with instance data firstInstance onwards from the
+  // last allocateInstanceData. Every pool's vertex array reads the instance data from one
+  // buffer, only where the batch starts has to be pointed at.
+  void drawMeshInstanced(Mesh* mesh, int firstInstance, int count) {
+    if (mesh->pool == NULL) // Still loading.
+      return;
+    bindVertexArray(mesh->pool->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    pointInstanceAttributes(instanceBase + firstInstance);
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mesh->nIndices, mesh->indexType,
+      BUFFER_OFFSET(mesh->firstIndex * mesh->indexSize), count, mesh->baseVertex);
+    // The arrays stay enabled for plain draws, which still fetch their first instance. An
+    // orphaned buffer can come back smaller next frame, so don't leave them pointing far in.
+    if (instanceRing == NULL)
+      pointInstanceAttributes(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void drawMesh(Mesh* mesh) {
+    if (mesh->pool == NULL) // Still loading.
+      return;
+    bindVertexArray(mesh->pool->vao);
+    glDrawElementsBaseVertex(GL_TRIANGLES, mesh->nIndices, mesh->indexType,
+      BUFFER_OFFSET(mesh->firstIndex * mesh->indexSize), mesh->baseVertex);
+  }
+
+  // Occlusion queries count the samples that pass the depth test between begin and end.
+  GLuint createQuery() {
+    GLuint query;
+    glGenQueries(1, &query);
+    return query;
+  }
+
+  void deleteQuery(GLuint query) {
+    glDeleteQueries(1, &query);
+  }
+
+  void beginOcclusionQuery(GLuint query) {
+    glBeginQuery(GL_SAMPLES_PASSED, query);
+  }
+
+  void endOcclusionQuery() {
+    glEndQuery(GL_SAMPLES_PASSED);
+  }
+
+  // Never waits for the GPU, false while the result isn't there yet.
+  bool queryResult(GLuint query, GLuint& samples) {
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      return false;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samples);
+    return true;
+  }
+
+  // Vertex array objects stay bound between draws, so switching only happens
+  // when the next mesh lives in another pool.
+  void bindVertexArray(GLuint vao) {
+    if (vao != currentVertexArray) {
+      glBindVertexArray(vao);
+      currentVertexArray = vao;
+      ++counters.issued;
+    }
+    else
+      ++counters.skipped;
+  }
+
+  void setIndexBuffer(IndexBuffer* buffer) {
+    bindVertexArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->id);
+  }
+
+  void setVertexBuffer(VertexBuffer* buffer) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer->id);
+  }
+
+private:
+  struct PendingTexture {
+    Texture* texture;
+    QString fileName;
+    QFuture<DecodedImage> future;
+    QList<AssetListener*> listeners;
+  };
+
+  struct PendingMesh {
+    Mesh* mesh;
+    QString fileName;
+    QFuture<MeshData> future;
+    QList<AssetListener*> listeners;
+  };
+
+  Texture* handOut(Texture* texture) {
+    ++texture->users;
+    return texture;
+  }
+
+  void addListener(QList<AssetListener*>& listeners, AssetListener* listener) {
+    if (listener == NULL)
+      return;
+    if (!listeners.contains(listener))
+      listeners << listener;
+    if (!waitingListeners.contains(listener))
+      waitingListeners << listener;
+  }
+
+  // Requests nobody listens to fail like the synchronous loads do.
+  void assetFailed(const QList<AssetListener*>& listeners, const QString& fileName, const QString& error) {
+    if (listeners.isEmpty())
       throw load_exception(error);
+    AssetListener* listener;
+    foreach (listener, listeners)
+      listener->assetFailed(fileName, error);
+  }
+
+  // Replaces the texture image and builds mipmaps. Through the pixel buffer the copy into
+  // GL memory is done by us and the transfer to the texture can happen asynchronously.
+  void uploadDecodedTexture(Texture* texture, const DecodedImage& decoded, bool viaPixelBuffer) {
+    if (decoded.compressed.isEmpty()) {
+      uploadTexture(texture, decoded.image.width(), decoded.image.height(), decoded.image.bits(), viaPixelBuffer);
+      return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    textureBound(texture->id);
+    uploadCompressedTexture(GL_TEXTURE_2D, decoded);
+    setCompressedSize(texture, decoded);
+  }
+
+  void setCompressedSize(Texture* texture, const DecodedImage& decoded) {
+    texture->width = decoded.width;
+    texture->height = decoded.height;
+    texture->internalFormat = decoded.compressedFormat;
+    texture->levels = decoded.levels;
+    texture->compressed = true;
+  }
+
+  // Uploads the precomputed mip chain as is, expects the texture to be bound to target
+  // (or to GL_TEXTURE_CUBE_MAP for one of its faces).
+  void uploadCompressedTexture(GLenum target, const DecodedImage& decoded) {
+    const char* data = decoded.compressed.constData() + DDS_HEADER_SIZE;
+    int width = decoded.width;
+    int height = decoded.height;
+    for (int level = 0; level < decoded.levels; ++level) {
+      const int size = ((width + 3) / 4) * ((height + 3) / 4) * compressedBlockBytes(decoded.compressedFormat);
+      glCompressedTexImage2D(target, level, decoded.compressedFormat, width, height, 0, size, data);
+      data += size;
+      width = qMax(width / 2, 1);
+      height = qMax(height / 2, 1);
+    }
+
+    if (target == GL_TEXTURE_2D) {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, decoded.levels - 1);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+  }
+
+  void uploadTexture(Texture* texture, int width, int height, const uchar* rgba, bool viaPixelBuffer) {
+    const GLvoid* pixels = rgba;
+    const int byteCount = width * height * 4;
+    if (viaPixelBuffer) {
+      if (pixelBuffer == 0)
+        glGenBuffers(1, &pixelBuffer);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+      // Orphan the previous storage, so we don't wait for the last transfer to finish.
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, byteCount, NULL, GL_STREAM_DRAW);
+      void* mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+      if (mapped != NULL) {
+        memcpy(mapped, rgba, byteCount);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        pixels = BUFFER_OFFSET(0);
+      }
+      else {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        viaPixelBuffer = false;
+      }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    textureBound(texture->id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+            width, height,
+            0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    if (viaPixelBuffer)
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    /*float maximumAnisotropy;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maximumAnisotropy);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maximumAnisotropy);*/
+
+    texture->height = height;
+    texture->width = width;
+    texture->internalFormat = GL_RGBA8;
+    texture->levels = 1;
+    while ((qMax(width, height) >> texture->levels) > 0)
+      ++texture->levels;
+    texture->compressed = false;
+  }
+
+  // Copies parsed mesh data into a geometry pool and releases the mapping.
+  void uploadMesh(MeshData& data, Mesh* mesh) {
+    const GLenum indexType = data.indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    GeometryPool* pool = findGeometryPool(data.format, indexType, data.nVertices, data.nIndices);
+
+    const quint64 vertexBytes = quint64(data.nVertices) * data.vertexSize;
+    const quint64 indexBytes = quint64(data.nIndices) * data.indexSize;
+    glBindBuffer(GL_ARRAY_BUFFER, pool->vertexBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, pool->verticesUsed * data.vertexSize, vertexBytes, data.vertexData);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bindVertexArray(pool->vao); // The element array binding is part of the vao state.
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, pool->indicesUsed * data.indexSize, indexBytes, data.indexData);
+
+    bindVertexArray(0);
+
+    data.release();
+
+    mesh->version = data.version;
+    mesh->pool = pool;
+    mesh->baseVertex = pool->verticesUsed;
+    mesh->firstIndex = pool->indicesUsed;
+    pool->verticesUsed += data.nVertices;
+    pool->indicesUsed += data.nIndices;
+    mesh->nVertices = data.nVertices;
+    mesh->vertexSize = data.vertexSize;
+    mesh->format = data.format;
+    mesh->nIndices = data.nIndices;
+    mesh->indexSize = data.indexSize;
+    mesh->indexType = indexType;
+    mesh->aabbMin = data.aabbMin;
+    mesh->aabbMax = data.aabbMax;
+  }
+
+  // Returns a pool with matching layout and enough free space, creating one if needed.
+  GeometryPool* findGeometryPool(const VertexFormat& format, GLenum indexType, unsigned int nVertices, unsigned int nIndices) {
+    GeometryPool* pool;
+    foreach (pool, geometryPools) {
+      if (pool->indexType == indexType && pool->format.sameLayout(format) &&
+          pool->verticesUsed + nVertices <= pool->vertexCapacity &&
+          pool->indicesUsed + nIndices <= pool->indexCapacity)
+        return pool;
+    }
+
+    pool = new GeometryPool;
+    pool->format = format;
+    pool->indexType = indexType;
+    pool->indexSize = indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+    pool->vertexCapacity = qMax(GEOMETRY_POOL_VERTEX_BYTES / format.stride, nVertices);
+    pool->indexCapacity = qMax(GEOMETRY_POOL_INDEX_BYTES / pool->indexSize, nIndices);
+    pool->verticesUsed = 0;
+    pool->indicesUsed = 0;
+
+    glGenBuffers(1, &(pool->vertexBuffer));
+    glBindBuffer(GL_ARRAY_BUFFER, pool->vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, pool->vertexCapacity * format.stride, NULL, GL_STATIC_DRAW);
+
+    glGenVertexArrays(1, &(pool->vao));
+    bindVertexArray(pool->vao);
+    glGenBuffers(1, &(pool->indexBuffer));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool->indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, pool->indexCapacity * pool->indexSize, NULL, GL_STATIC_DRAW);
+    format.apply();
+
+    // Non instanced draws from the pool still fetch the first transform, so the buffer
+    // is never empty.
+    if (instanceBuffer == 0)
+      createInstanceBuffer(INSTANCE_RING_REGION_FLOATS);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    for (GLuint attribute = INSTANCE_ATTRIBUTE; attribute <= INSTANCE_LAYER_ATTRIBUTE; ++attribute) {
+      glEnableVertexAttribArray(attribute);
+      glVertexAttribDivisor(attribute, 1);
+    }
+    pointInstanceAttributes(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    geometryPools << pool;
+    std::cout << "Created geometry pool " << geometryPools.size() << " (stride " << format.stride << ")" << std::endl;
+    return pool;
+  }
+
+  bool checkSuccess(GLenum shader) {
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+
+    if (!compiled) {
+      char* log = new char[1000];
+      glGetShaderInfoLog(shader, 1000, NULL, log);
+      QString info(log);
+      std::cout << info.trimmed().toUtf8().constData() << std::endl;
+      delete [] log;
+    }
+
+    return compiled;
+  }
+
+  // With ARB_buffer_storage the instance buffer is a persistently mapped ring of one
+  // region per frame in flight. A fence is put behind each frame's draws, the region is
+  // written again only once its fence has signalled. Without it the buffer is orphaned
+  // on every commit.
+  void createInstanceBuffer(unsigned int regionFloats) {
+    instanceRegionFloats = regionFloats;
+    ringFrame = 0;
+    ringUsed = 0;
+    glGenBuffers(1, &instanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    if (GLEW_ARB_buffer_storage) {
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      const GLsizeiptr size = INSTANCE_RING_FRAMES * regionFloats * sizeof(GLfloat);
+      glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+      instanceRing = static_cast<GLfloat*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+    }
+    else
+      glBufferData(GL_ARRAY_BUFFER, regionFloats * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void deleteInstanceBuffer() {
+    for (int i = 0; i < INSTANCE_RING_FRAMES; ++i)
+      waitForRegion(i);
+    if (instanceRing != NULL) {
+      glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (instanceBuffer != 0)
+      glDeleteBuffers(1, &instanceBuffer);
+    instanceBuffer = 0;
+    instanceRing = NULL;
+  }
+
+  // Fences the region written this frame and moves on to the next one.
+  void advanceInstanceRing() {
+    if (instanceRing == NULL || ringUsed == 0)
+      return;
+    ringFences[ringFrame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ringFrame = (ringFrame + 1) % INSTANCE_RING_FRAMES;
+    ringUsed = 0;
+  }
+
+  void waitForRegion(int frame) {
+    GLsync& fence = ringFences[frame];
+    if (fence == 0)
+      return;
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+      ;
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  // Expects the vertex array object and the instance buffer to be bound.
+  void pointInstanceAttributes(int firstInstance) {
+    const unsigned int offset = firstInstance * INSTANCE_FLOATS * sizeof(GLfloat);
+    for (GLuint column = 0; column < 4; ++column)
+      glVertexAttribPointer(INSTANCE_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS * sizeof(GLfloat),
+        BUFFER_OFFSET(offset + column * 4 * sizeof(GLfloat)));
+    glVertexAttribPointer(INSTANCE_LAYER_ATTRIBUTE, 1, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS * sizeof(GLfloat),
+      BUFFER_OFFSET(offset + 16 * sizeof(GLfloat)));
+  }
+
+  // Allocates every level of an array shaped like the given texture.
+  Texture* createTextureArray(const Texture* shape, int layers) {
+    Texture* array = new Texture;
+    array->target = GL_TEXTURE_2D_ARRAY;
+    array->width = shape->width;
+    array->height = shape->height;
+    array->internalFormat = shape->internalFormat;
+    array->levels = shape->levels;
+    array->compressed = shape->compressed;
+    glGenTextures(1, &(array->id));
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array->id);
+    textureBound(array->id);
+
+    int width = array->width;
+    int height = array->height;
+    for (int level = 0; level < array->levels; ++level) {
+      if (array->compressed) {
+        const int size = ((width + 3) / 4) * ((height + 3) / 4) * compressedBlockBytes(array->internalFormat);
+        glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, array->internalFormat, width, height, layers, 0, size * layers, NULL);
+      }
+      else
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, array->internalFormat, width, height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+      width = qMax(width / 2, 1);
+      height = qMax(height / 2, 1);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, array->levels - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    textures << array;
+    return array;
+  }
+
+  // Copies all levels of texture into one layer of array, on the GPU if the driver can.
+  // Expects array to be bound to GL_TEXTURE_2D_ARRAY.
+  void copyToLayer(Texture* texture, Texture* array, int layer) {
+    texture->array = array;
+    texture->layer = layer;
+    if (!GLEW_ARB_copy_image) {
+      glBindTexture(GL_TEXTURE_2D, texture->id);
+      textureBound(texture->id);
+    }
+
+    int width = texture->width;
+    int height = texture->height;
+    QByteArray pixels;
+    for (int level = 0; level < texture->levels; ++level) {
+      if (GLEW_ARB_copy_image) {
+        glCopyImageSubData(texture->id, GL_TEXTURE_2D, level, 0, 0, 0,
+          array->id, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1);
+      }
+      else if (texture->compressed) {
+        GLint size = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+        pixels.resize(size);
+        glGetCompressedTexImage(GL_TEXTURE_2D, level, pixels.data());
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1,
+          texture->internalFormat, size, pixels.constData());
+      }
+      else {
+        pixels.resize(width * height * 4);
+        glGetTexImage(GL_TEXTURE_2D, level, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels.constData());
+      }
+      width = qMax(width / 2, 1);
+      height = qMax(height / 2, 1);
     }
+  }
 
-    unsigned int version, nVertices, nIndices, vertexSize, indexSize;
-    file.read(reinterpret_cast<char*>(&version), 4); // TODO: endianness?
-    file.read(reinterpret_cast<char*>(&nVertices), 4);
-    file.read(reinterpret_cast<char*>(&nIndices), 4);
-    file.read(reinterpret_cast<char*>(&vertexSize), 4);
-    file.read(reinterpret_cast<char*>(&indexSize), 4);
+  // Loaders bind textures on whatever unit is active, keep the state cache up to date.
+  void textureBound(GLuint id) {
+    if (activeTextureUnit < MAX_TRACKED_TEXTURE_UNITS)
+      boundTextures[activeTextureUnit] = id;
+    else
+      for (unsigned int i = 0; i < MAX_TRACKED_TEXTURE_UNITS; ++i)
+        boundTextures[i] = UNKNOWN_STATE;
+  }
 
-    if (version < 1)
-      throw load_exception(QString("Unknown mesh version!"));
+  GLuint compileStage(GLenum type, const QByteArray& source) {
+    GLuint shader = glCreateShader(type);
+    const GLchar* data = source.constData();
+    GLint length = source.size();
+    glShaderSource(shader, 1, &data, &length);
+    glCompileShader(shader);
+    return shader;
+  }
 
-    std::vector<char> data;
-    data.resize(nVertices * vertexSize);
-    file.read(reinterpret_cast<char*>(&data[0]), nVertices * vertexSize);
-    if (file.eof()) {
-      QString error = "End of file reached while reading ";
-      error += fileName;
-      error += "!";
-      throw load_exception(error);
-    }
-    VertexBuffer* vertexBuffer = this->addVertexBuffer(reinterpret_cast<char*>(&data[0]), nVertices * vertexSize, GL_STATIC_DRAW);
+  void finishShader(Shader* shader) {
+    shader->pending = false;
+    pendingShaders.removeAll(shader);
 
-    data.resize(nIndices * indexSize);
-    file.read(reinterpret_cast<char*>(&data[0]), nIndices * indexSize);
-    if (file.eof()) {
-      QString error = "End of file reached while reading ";
-      error += fileName;
-      error += "!";
-      throw load_exception(error);
-    }
-    IndexBuffer* indexBuffer = this->addIndexBuffer(reinterpret_cast<char*>(&data[0]), nIndices * indexSize, GL_STATIC_DRAW);
+    if (!checkSuccess(shader->vertexShader))
+      throw load_exception("Failed to compile vertex shader " + shader->name + "!");
+    if (!checkSuccess(shader->pixelShader))
+      throw load_exception("Failed to compile pixel shader " + shader->name + "!");
 
-    file.close();
+    GLint linked;
+    glGetProgramiv(shader->program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+      char* log = new char[1000];
+      glGetProgramInfoLog(shader->program, 1000, NULL, log);
+      QString info(log);
+      std::cout << info.trimmed().toUtf8().constData() << std::endl;
+      delete [] log;
+      throw load_exception("Failed to link shader " + shader->name + "!");
+    }
 
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    reflectUniforms(shader);
+    if (!shader->cacheKey.isEmpty())
+      saveProgramBinary(shader);
+  }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer->id);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->id);
-    // TODO: implement VertexFormat structure
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertexSize, BUFFER_OFFSET(0));
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, vertexSize, BUFFER_OFFSET(3*4));
-    glEnableVertexAttribArray(1);
-    if (vertexSize >= 32) {
-      glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, vertexSize, BUFFER_OFFSET(6*4));
-      glEnableVertexAttribArray(2);
+  void reflectUniforms(Shader* shader) {
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(shader->program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(shader->program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    QVector<GLint>& locations = shader->uniformLocations;
+    locations.clear();
+    shader->samplerUnits.clear(); // Linking resets the uniform values.
+    shader->instanced = glGetAttribLocation(shader->program, "instanceModel") == GLint(INSTANCE_ATTRIBUTE);
+    shader->textureArrays = false;
+    QByteArray buffer(maxLength + 1, '\0');
+    for (GLint i = 0; i < count; ++i) {
+      GLsizei length = 0;
+      GLint size;
+      GLenum type;
+      glGetActiveUniform(shader->program, i, buffer.size(), &length, &size, &type, buffer.data());
+      QByteArray name(buffer.constData(), length);
+      if (name.endsWith("[0]"))
+        name.chop(3); // Arrays are set through their first element.
+
+      const GLint location = glGetUniformLocation(shader->program, name.constData());
+      if (location < 0)
+        continue; // Built-in, or a member of a uniform block.
+      if (name == "texture0" && type == GL_SAMPLER_2D_ARRAY)
+        shader->textureArrays = true;
+
+      const UniformId id = uniformId(name.constData());
+      while (locations.size() <= id)
+        locations << -1;
+      locations[id] = location;
     }
-    if (vertexSize >= 40) {
-      glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, vertexSize, BUFFER_OFFSET(8*4));
-      glEnableVertexAttribArray(3);
-    }
-    if (vertexSize >= 48) {
-      glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, vertexSize, BUFFER_OFFSET(10*4));
-      glEnableVertexAttribArray(4);
+
+    if (GLEW_ARB_uniform_buffer_object) {
+      const GLuint frameBlock = glGetUniformBlockIndex(shader->program, "Frame");
+      if (frameBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(shader->program, frameBlock, FRAME_UNIFORM_BINDING);
     }
+  }
 
-    glBindVertexArray(0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  void initProgramCache() {
+    if (!driverId.isEmpty())
+      return;
 
-    Mesh* mesh = new Mesh;
-    mesh->version = version;
-    mesh->vertexBuffer = vertexBuffer;
-    mesh->indexBuffer = indexBuffer;
-    mesh->nVertices = nVertices;
-    mesh->vertexSize = vertexSize;
-    mesh->nIndices = nIndices;
-    mesh->indexSize = indexSize;
-    mesh->vao = vao;
-    meshes << mesh;
+    driverId = QByteArray((const char*)glGetString(GL_VENDOR)) + "\n" +
+      QByteArray((const char*)glGetString(GL_RENDERER)) + "\n" +
+      QByteArray((const char*)glGetString(GL_VERSION));
 
-    loadedMeshes[fullPath] = mesh;
-    std::cout << "Loaded mesh " << fileName <<  std::endl;
-    return mesh;
-  }
+    GLint formats = 0;
+    if (GLEW_ARB_get_program_binary)
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    programBinaries = formats > 0;
 
-  void drawMesh(Mesh* mesh) {
-    glBindVertexArray(mesh->vao);
-    glDrawElements(GL_TRIANGLES, mesh->nIndices, GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
+    // Let the driver compile on its own threads while we keep loading. Needs GLEW 2.1.
+#ifdef GL_KHR_parallel_shader_compile
+    if (GLEW_KHR_parallel_shader_compile)
+      glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+#endif
   }
 
-  void setIndexBuffer(IndexBuffer* buffer) {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->id);
+  QString programCacheFile(const Shader* shader) const {
+    return PROGRAM_CACHE_DIR + "/" + shader->cacheKey + ".bin";
   }
 
-  void setVertexBuffer(VertexBuffer* buffer) {
-    glBindBuffer(GL_ARRAY_BUFFER, buffer->id);
-  }
+  // Cache files hold the binary format (4 bytes) followed by the program binary.
+  bool loadProgramBinary(Shader* shader) {
+    QFile file(programCacheFile(shader));
+    if (!file.open(QIODevice::ReadOnly))
+      return false;
+    QByteArray data = file.readAll();
+    file.close();
+    if (data.size() <= 4)
+      return false;
 
-private:
-  bool checkSuccess(GLenum shader) {
-    GLint compiled;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    quint32 format;
+    memcpy(&format, data.constData(), 4);
+    glProgramBinary(shader->program, format, data.constData() + 4, data.size() - 4);
 
-    if (!compiled) {
-      char* log = new char[1000];
-      glGetShaderInfoLog(shader, 1000, NULL, log);
-      QString info(log);
-      std::cout << info.trimmed().toUtf8().constData() << std::endl;
-      delete [] log;
-    }
+    // Drivers reject binaries from other versions, the caller recompiles then.
+    GLint linked = GL_FALSE;
+    glGetProgramiv(shader->program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+  }
 
-    return compiled;
+  void saveProgramBinary(const Shader* shader) {
+    GLint length = 0;
+    glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+      return;
+
+    QByteArray data(4 + length, '\0');
+    GLenum format = 0;
+    glGetProgramBinary(shader->program, length, NULL, &format, data.data() + 4);
+    const quint32 format32 = format;
+    memcpy(data.data(), &format32, 4);
+
+    QDir().mkpath(PROGRAM_CACHE_DIR);
+    QFile file(programCacheFile(shader));
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size())
+      std::cout << "Could not write " << file.fileName().toStdString() << std::endl;
   }
 
   QList<Shader*> shaders;
@@ -568,13 +2394,62 @@ private:
   QList<IndexBuffer*> indexBuffers;
   QList<VertexBuffer*> vertexBuffers;
   QList<Mesh*> meshes;
+  QList<GeometryPool*> geometryPools;
 
   QHash<QString, Shader*> loadedShaders;
   QHash<QString, Texture*> loadedTextures;
   QHash<QString, Mesh*> loadedMeshes;
 
+  QList<PendingTexture> pendingTextures;
+  QList<PendingMesh> pendingMeshes;
+  QList<AssetListener*> waitingListeners; // Get assetsLoaded once nothing is pending.
+  GLuint pixelBuffer;
+  GLuint frameUniformBuffer;
+  GLuint instanceBuffer;
+  static const int INSTANCE_RING_FRAMES = 3;
+  static const unsigned int INSTANCE_RING_REGION_FLOATS = 4096 * INSTANCE_FLOATS;
+  GLfloat* instanceRing; // Mapped instance buffer, NULL if it has to be orphaned instead.
+  unsigned int instanceRegionFloats; // Size of one frame's region.
+  int ringFrame; // Region written this frame.
+  unsigned int ringUsed; // Floats of the region handed out this frame.
+  GLsync ringFences[INSTANCE_RING_FRAMES];
+  unsigned int instanceBase; // Instance the last allocation starts at, within the buffer.
+  QVector<GLfloat> instanceStaging;
+
+  QList<Shader*> pendingShaders;
+  QByteArray driverId; // Vendor, renderer and version, part of the program cache key.
+  bool programBinaries;
+
   GLuint currentProgram;
   Shader* currentShader;
+  GLuint currentVertexArray;
+
+  static const GLuint UNKNOWN_STATE = ~0u;
+  static const unsigned int MAX_TRACKED_TEXTURE_UNITS = 8;
+  static const int TRACKED_CAPABILITIES = 3;
+  GLuint activeTextureUnit;
+  GLuint boundTextures[MAX_TRACKED_TEXTURE_UNITS];
+  GLuint capabilities[TRACKED_CAPABILITIES];
+  GLuint alphaFunc, blendSource, blendDestination, depthFunc, depthMask, colorMask;
+  StateCounters counters;
+};
+
+// Uniforms that are set for every object.
+const UniformId UNIFORM_PROJ = Renderer::uniformId("proj");
+const UniformId UNIFORM_MODEL_VIEW = Renderer::uniformId("modelView");
+const UniformId UNIFORM_MODEL = Renderer::uniformId("model");
+const UniformId UNIFORM_LIGHT_DIR = Renderer::uniformId("light_dir");
+const UniformId UNIFORM_CAM_POS = Renderer::uniformId("cam_pos");
+const UniformId UNIFORM_HEIGHT_DECODE = Renderer::uniformId("height_decode");
+const UniformId UNIFORM_DEPTH = Renderer::uniformId("depth");
+const UniformId UNIFORM_SKY = Renderer::uniformId("sky");
+const UniformId UNIFORM_TEXTURE = Renderer::uniformId("texture");
+const UniformId UNIFORM_TEXTURES[5] = {
+  Renderer::uniformId("texture0"),
+  Renderer::uniformId("texture1"),
+  Renderer::uniformId("texture2"),
+  Renderer::uniformId("texture3"),
+  Renderer::uniformId("texture4")
 };
 
 App::App(const QGLFormat& format, ConfigurationWindow* configWin) :
@@ -689,7 +2564,7 @@ void App::initializeGL() {
     chassisShader = renderer->addShader("content/chassis.shader");
     env = renderer->addShader("content/env.shader");
 
-    wheelTexture = renderer->addTexture("content/wheel-ambient.jpg");
+    wheelTexture = renderer->requestTexture("content/wheel-ambient.jpg");
 
     const char* cubemap_files[] = {"content/cubemap/1.jpg",
       "content/cubemap/2.jpg",
@@ -699,17 +2574,19 @@ void App::initializeGL() {
       "content/cubemap/6.jpg",
       };
     envCubemap = renderer->addCubemap(cubemap_files);
-    carTexture = renderer->addTexture("content/car-texture.png");
+    carTexture = renderer->requestTexture("content/car-texture.png");
 
     blur = renderer->addShader("content/blur.shader");
     plain = renderer->addShader("content/plain.shader");
-    speedometerBack = renderer->addTexture("content/speedometer-back.png");
-    speedometerFront = renderer->addTexture("content/speedometer-front.png");
+    speedometerBack = renderer->requestTexture("content/speedometer-back.png");
+    speedometerFront = renderer->requestTexture("content/speedometer-front.png");
 
     this->setupPhysics();
 
-    scene = new BlenderScene("content/level1/level1.scene", dynamicsWorld, renderer);
+    scene = new BlenderScene("content/level1/level1.scenebin", dynamicsWorld, renderer);
 
+    // The driver compiled the shaders while everything else was loading.
+    renderer->finishShaders();
   } catch (load_exception& e) {
     std::cout << "Exception: " << e.what() << std::endl;
     this->parentWidget()->close();
@@ -815,13 +2692,14 @@ void App::initializeGL() {
   renderText(0,0, "Otherwise there would be a hickup", highscoreFont);
 
   mat4 projection, sunProjection;
-  projection.perspective(fov, float(width()) / height(), 0.5, 900.);
+  projection.perspective(fov, float(width()) / height(), NEAR_PLANE, FAR_PLANE);
   sunProjection.ortho(-3, 3, -3, 3, -10, 100);
   ctx.projection = projection;
   ctx.sunProjection = sunProjection;
   ctx.sunDirection = vec3(0,1,3).normalized();
 
   ctx.frustumCulling = true;
+  ctx.occlusionCulling = true;
   ctx.depthBuffer = shadowDepthTexture;
 
   state = App::Counting;
@@ -929,24 +2807,122 @@ void App::setupPhysics() {
   dynamicsWorld->setDebugDrawer(debugDrawer);
 }
 
-BlenderScene::BlenderScene(const char* fileName, btDynamicsWorld* world, Renderer* renderer) {
-  if (!QFile::exists(fileName))
-    throw load_exception(QString("Scene file ") + fileName + " does not exist!");
+const int SCENE_HEADER_SIZE = 6 * 4;
+const quint32 SCENE_VERSION = 1;
+
+// Records of a .scenebin file as written by scenetool.py.
+struct SceneAssetRecord {
+  enum Type {
+    TextureAsset = 0,
+    MeshAsset,
+    ShaderAsset
+  };
+
+  quint32 type;
+  quint32 name; // Index into the string table.
+};
+
+struct SceneObjectRecord {
+  enum Flags {
+    Transparent = 1,
+    HasTransform = 2,
+    NoBatch = 4
+  };
+
+  quint32 name;
+  quint32 flags;
+  qint32 mesh, shader; // Indices into the asset table, -1 if the object has none.
+  qint32 textures[5];
+  float position[3];
+  float rotation[4];   // x, y, z, w
+};
+
+struct SceneAsset {
+  SceneAsset() {
+    texture = NULL;
+    mesh = NULL;
+    shader = NULL;
+  }
+
+  Texture* texture;
+  Mesh* mesh;
+  Shader* shader;
+};
+
+bool validSceneAsset(const SceneAssetRecord* assets, quint32 nAssets, qint32 index, quint32 type) {
+  return index < 0 || (quint32(index) < nAssets && assets[index].type == type);
+}
 
+// Depths in the render queue keys are divided by this, nothing beyond the far plane is drawn.
+const float SORT_DEPTH_RANGE = FAR_PLANE;
+
+// Static batches only merge objects within one cell of this size, so they stay cullable.
+const float STATIC_BATCH_CELL_SIZE = 64;
+// Keeps batches on 16-bit indices.
+const unsigned int MAX_STATIC_BATCH_VERTICES = 0x10000;
+
+// Below this many draw commands handing work to other threads costs more than it saves.
+const int MIN_COMMANDS_PER_THREAD = 512;
+
+// Occlusion query results arrive a frame or more late. An occluded result is trusted for
+// this many frames after its query was issued, older ones no longer hide anything.
+const int OCCLUSION_MAX_AGE = 4;
+// Visible objects are tested again every this many frames, staggered over the commands.
+const int OCCLUSION_REQUERY_INTERVAL = 8;
+// Query proxies are this much larger than the bounds, so their front faces stay in front
+// of the object's own surfaces in the depth buffer.
+const float OCCLUSION_BOX_MARGIN = 0.25f;
+// Proxies are only drawn when the camera is farther than this from them, so the near
+// plane never clips away their front faces.
+const float OCCLUSION_NEAR_CLEARANCE = 1;
+
+const GeometryPool* BlenderScene::RenderableObject::meshPool() const {
+  return mesh != NULL ? mesh->getPool() : NULL;
+}
+
+BlenderScene::BlenderScene(const char* fileName, btDynamicsWorld* world, Renderer* renderer) {
   this->world = world;
   this->renderer = renderer;
   importer = NULL;
+  commandsValid = false;
+  frameNumber = 0;
+  occlusionShader = renderer->addShader("content/plain.shader");
+  occlusionBox = renderer->createBoxMesh();
+  framePool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1)); // The GL thread does a part too.
 
   QFileInfo info(fileName);
   QString path = info.absolutePath() + QDir::separator();
   QString bulletFile = path + info.baseName() + ".bullet";
+  QString packFile = path + info.baseName() + ".pack";
+
+  // A pack next to the scene (see packtool.py) replaces all the loose files.
+  Pack pack;
+  if (QFile::exists(packFile)) {
+    if (pack.open(packFile))
+      std::cout << "Loading scene from " << packFile.toStdString() << std::endl;
+    else
+      std::cout << pack.errorString().toStdString() << std::endl;
+  }
+
+  if (!pack.isOpen() && !QFile::exists(fileName))
+    throw load_exception(QString("Scene file ") + fileName + " does not exist!");
 
   bool physicsDataPresent = false;
+  const Pack::Entry* bulletEntry = pack.isOpen() ? pack.find(info.baseName() + ".bullet") : NULL;
 
-  if (QFile::exists(bulletFile)) {
+  if (bulletEntry != NULL || QFile::exists(bulletFile)) {
     importer = new btBulletWorldImporter(world);
 
-    if (!importer->loadFile(bulletFile.toStdString().c_str())) {
+    bool loaded;
+    if (bulletEntry != NULL) {
+      // Bullet fixes up pointers in place, so it has to get its own copy.
+      QByteArray buffer(reinterpret_cast<const char*>(pack.data(bulletEntry)), bulletEntry->size);
+      loaded = importer->loadFileFromMemory(buffer.data(), buffer.size());
+    }
+    else
+      loaded = importer->loadFile(bulletFile.toStdString().c_str());
+
+    if (!loaded) {
       std::cout << "Could not load physics data from " << bulletFile.toStdString() << "!" << std::endl;
     }
     else {
@@ -961,59 +2937,88 @@ BlenderScene::BlenderScene(const char* fileName, btDynamicsWorld* world, Rendere
   else
     std::cout << "Could not load physics data from " << bulletFile.toStdString() << "!" << std::endl;
 
-  QDomDocument doc;
-  QFile file(fileName);
+  // Layout is described in scenetool.py. The file is read in one go, kept for the object
+  // names and the objects are filled straight from its records.
+  const Pack::Entry* sceneEntry = pack.isOpen() ? pack.find(info.fileName()) : NULL;
+  if (sceneEntry != NULL)
+    sceneData = QByteArray(reinterpret_cast<const char*>(pack.data(sceneEntry)), sceneEntry->size);
+  else {
+    QFile file(fileName);
 
-  if (!file.open(QIODevice::ReadOnly)) {
-    QString error = "Error opening file ";
-    error += fileName;
-    throw load_exception(error.toStdString());
-  }
+    if (!file.open(QIODevice::ReadOnly)) {
+      QString error = "Error opening file ";
+      error += fileName;
+      throw load_exception(error.toStdString());
+    }
 
-  QString msg;
-  if (!doc.setContent(&file, false, &msg)) {
+    sceneData = file.readAll();
     file.close();
-    QString error = "Error loading file ";
-    error += fileName;
-    error += " [";
-    error += msg + "]";
-    throw load_exception(error.toStdString());
   }
 
-  file.close();
-
-  QDomNodeList nodes = doc.elementsByTagName("object");
+  const quint32* header = reinterpret_cast<const quint32*>(sceneData.constData());
+  if (sceneData.size() < SCENE_HEADER_SIZE || memcmp(header, "MTSC", 4) != 0 || header[1] != SCENE_VERSION)
+    throw load_exception(QString("Unknown scene format in ") + fileName + "! Compile the .scene with scenetool.py.");
+
+  const quint32 nStrings = header[2];
+  const quint32 stringsSize = header[3];
+  const quint32 nAssets = header[4];
+  const quint32 nObjects = header[5];
+  if (SCENE_HEADER_SIZE + quint64(nStrings) * 4 + stringsSize + quint64(nAssets) * sizeof(SceneAssetRecord) +
+      quint64(nObjects) * sizeof(SceneObjectRecord) > quint64(sceneData.size()) || stringsSize % 4 != 0)
+    throw load_exception(QString("Header of ") + fileName + " does not match the file size!");
+
+  const quint32* stringOffsets = header + SCENE_HEADER_SIZE / 4;
+  const char* strings = reinterpret_cast<const char*>(stringOffsets + nStrings);
+  const SceneAssetRecord* assetRecords = reinterpret_cast<const SceneAssetRecord*>(strings + stringsSize);
+  const SceneObjectRecord* objectRecords = reinterpret_cast<const SceneObjectRecord*>(assetRecords + nAssets);
+
+  // Validate everything up front, so the loops below can index without checks.
+  bool valid = stringsSize == 0 || strings[stringsSize - 1] == '\0';
+  for (quint32 i = 0; i < nStrings && valid; ++i)
+    valid = stringOffsets[i] < stringsSize;
+  for (quint32 i = 0; i < nAssets && valid; ++i)
+    valid = assetRecords[i].name < nStrings && assetRecords[i].type <= SceneAssetRecord::ShaderAsset;
+  for (quint32 i = 0; i < nObjects && valid; ++i) {
+    const SceneObjectRecord& record = objectRecords[i];
+    valid = record.name < nStrings &&
+      validSceneAsset(assetRecords, nAssets, record.mesh, SceneAssetRecord::MeshAsset) &&
+      validSceneAsset(assetRecords, nAssets, record.shader, SceneAssetRecord::ShaderAsset);
+    for (int t = 0; t < 5 && valid; ++t)
+      valid = validSceneAsset(assetRecords, nAssets, record.textures[t], SceneAssetRecord::TextureAsset);
+  }
+  if (!valid)
+    throw load_exception(QString("Corrupt scene file ") + fileName + "!");
+
+  // Every asset is resolved once, not once per object referencing it.
+  QVector<SceneAsset> assets(nAssets);
+  for (quint32 i = 0; i < nAssets; ++i) {
+    const QString name = QString::fromUtf8(strings + stringOffsets[assetRecords[i].name]);
+    switch (assetRecords[i].type) {
+      case SceneAssetRecord::TextureAsset: assets[i].texture = loadTexture(pack, path, name); break;
+      case SceneAssetRecord::MeshAsset:    assets[i].mesh = loadMesh(pack, path, name); break;
+      case SceneAssetRecord::ShaderAsset:  assets[i].shader = loadShader(pack, path, name); break;
+    }
+  }
 
-  for (unsigned int i = 0; i < nodes.length(); ++i) {
-    QDomElement e = nodes.at(i).toElement();
+  objects.reserve(nObjects);
+  for (quint32 i = 0; i < nObjects; ++i) {
+    const SceneObjectRecord& record = objectRecords[i];
     RenderableObject object;
-    if (e.hasAttribute("name"))
-      object.name = e.attribute("name");
-
-    if (e.hasAttribute("texture0"))
-      object.texture0 = renderer->addTexture((path+e.attribute("texture0")).toStdString().c_str());
-    if (e.hasAttribute("texture1"))
-      object.texture1 = renderer->addTexture((path+e.attribute("texture1")).toStdString().c_str());
-    if (e.hasAttribute("texture2"))
-      object.texture2 = renderer->addTexture((path+e.attribute("texture2")).toStdString().c_str());
-    if (e.hasAttribute("texture3"))
-      object.texture3 = renderer->addTexture((path+e.attribute("texture3")).toStdString().c_str());
-    if (e.hasAttribute("texture4"))
-      object.texture4 = renderer->addTexture((path+e.attribute("texture4")).toStdString().c_str());
-
-    if (e.hasAttribute("mesh"))
-      object.mesh = renderer->addMesh((path+e.attribute("mesh")).toStdString().c_str());
-
-    if (e.hasAttribute("shader"))
-      object.shader = renderer->addShader((path+e.attribute("shader")).toStdString().c_str());
-
-    if (e.hasAttribute("transparent"))
-      object.transparent = true;
+    object.name = strings + stringOffsets[record.name];
+    object.texture0 = record.textures[0] < 0 ? NULL : assets[record.textures[0]].texture;
+    object.texture1 = record.textures[1] < 0 ? NULL : assets[record.textures[1]].texture;
+    object.texture2 = record.textures[2] < 0 ? NULL : assets[record.textures[2]].texture;
+    object.texture3 = record.textures[3] < 0 ? NULL : assets[record.textures[3]].texture;
+    object.texture4 = record.textures[4] < 0 ? NULL : assets[record.textures[4]].texture;
+    object.mesh = record.mesh < 0 ? NULL : assets[record.mesh].mesh;
+    object.shader = record.shader < 0 ? NULL : assets[record.shader].shader;
+    object.transparent = (record.flags & SceneObjectRecord::Transparent) != 0;
+    object.batchable = (record.flags & SceneObjectRecord::NoBatch) == 0;
 
     if (physicsDataPresent) {
-      object.body = importer->getRigidBodyByName(object.name.toStdString().c_str());
+      object.body = importer->getRigidBodyByName(object.name);
       if (object.body != NULL && object.body->getMotionState() == NULL) {
-        std::cout << "Adding " << object.name.toStdString() << "..." << std::endl;
+        std::cout << "Adding " << object.name << "..." << std::endl;
         btVector3 translation = object.body->getCenterOfMassPosition();
         btQuaternion orientation = object.body->getOrientation();
         btTransform transform(orientation, translation);
@@ -1023,22 +3028,15 @@ BlenderScene::BlenderScene(const char* fileName, btDynamicsWorld* world, Rendere
     }
 
     if (object.body == NULL) {
-      std::cout << "Adding a ghost called " << object.name.toStdString() << "..." << std::endl;
+      std::cout << "Adding a ghost called " << object.name << "..." << std::endl;
       object.ghost = true;
-      QDomElement position = nodes.at(i).firstChildElement("position");
-      QDomElement rotation = nodes.at(i).firstChildElement("rotation");
-      if (position.isNull() || rotation.isNull() ||
-        !position.hasAttribute("x") || !position.hasAttribute("y") || !position.hasAttribute("z") ||
-        !rotation.hasAttribute("x") || !rotation.hasAttribute("y") || !rotation.hasAttribute("z") || !rotation.hasAttribute("w")) {
+      if (!(record.flags & SceneObjectRecord::HasTransform)) {
         std::cout << "Incorrectly formatted .scene file (missing attributes/nodes)!" << std::endl;
         continue;
       }
 
-      btVector3 pos(position.attribute("x").toFloat(), position.attribute("y").toFloat(), position.attribute("z").toFloat());
-      btQuaternion rot(rotation.attribute("x").toFloat(),
-          rotation.attribute("y").toFloat(),
-          rotation.attribute("z").toFloat(),
-          rotation.attribute("w").toFloat());
+      btVector3 pos(record.position[0], record.position[1], record.position[2]);
+      btQuaternion rot(record.rotation[0], record.rotation[1], record.rotation[2], record.rotation[3]);
       object.transform.setIdentity();
       object.transform.setOrigin(pos);
       object.transform.setRotation(rot);
@@ -1047,100 +3045,582 @@ BlenderScene::BlenderScene(const char* fileName, btDynamicsWorld* world, Rendere
     objects << object;
   }
 
-  qSort(objects.begin(), objects.end()); // Sort objects by shader (minimize state changes).
   std::cout << "Added " << objects.size() << " objects to the world." << std::endl;
+
+  // Packed assets are uploaded by now, otherwise assetsLoaded follows once they stream in.
+  if (renderer->isWaiting(this))
+    assignSortIds();
+  else
+    assetsLoaded();
 }
 
 BlenderScene::~BlenderScene() {
+  renderer->removeAssetListener(this);
+  deleteQueries();
   delete importer;
 }
 
-void BlenderScene::draw(qint64 delta, RenderContext& ctx) {
-  const GLfloat bias[16] = {
-    0.5, 0.0, 0.0, 0.0,
-    0.0, 0.5, 0.0, 0.0,
-    0.0, 0.0, 0.5, 0.0,
-    0.5, 0.5, 0.5, 1.0};
+// Packed assets are GPU ready and uploaded right away, loose files are streamed in.
+Texture* BlenderScene::loadTexture(const Pack& pack, const QString& path, const QString& name) {
+  if (pack.isOpen())
+    return renderer->addTexture(pack, name);
+  return renderer->requestTexture((path+name).toStdString().c_str(), this);
+}
 
-  ctx.objectsDrawn = 0;
+Mesh* BlenderScene::loadMesh(const Pack& pack, const QString& path, const QString& name) {
+  if (pack.isOpen())
+    return renderer->addMesh(pack, name);
+  return renderer->requestMesh((path+name).toStdString().c_str(), this);
+}
+
+Shader* BlenderScene::loadShader(const Pack& pack, const QString& path, const QString& name) {
+  if (pack.isOpen())
+    return renderer->addShader(pack, name);
+  return renderer->addShader((path+name).toStdString().c_str());
+}
 
+void BlenderScene::meshLoaded(Mesh* /*mesh*/) {
+  commandsValid = false;
+}
+
+// The level isn't playable with an asset missing.
+void BlenderScene::assetFailed(const QString& fileName, const QString& error) {
+  throw load_exception("Scene asset " + fileName + " failed to load: " + error);
+}
+
+void BlenderScene::assetsLoaded() {
+  commandsValid = false;
+  buildTextureArrays();
+  buildStaticBatches();
+  // Geometry pools are only known once the meshes are uploaded.
+  assignSortIds();
+  std::cout << "All assets of the scene loaded." << std::endl;
+}
+
+// texture0 of objects whose shader samples a texture array gets packed into one.
+void BlenderScene::buildTextureArrays() {
+  QList<Texture*> textures;
   for (int i = 0; i < objects.size(); ++i) {
     const RenderableObject& object = objects.at(i);
+    if (object.shader != NULL && object.texture0 != NULL && renderer->usesTextureArrays(object.shader) &&
+        !textures.contains(object.texture0))
+      textures << object.texture0;
+  }
+  renderer->buildTextureArrays(textures);
 
-    if (object.shader == NULL || object.mesh == NULL)
+  // The 2D images are only kept for objects that still bind them.
+  for (int i = 0; i < objects.size(); ++i) {
+    RenderableObject& object = objects[i];
+    const bool arrays = object.shader != NULL && renderer->usesTextureArrays(object.shader);
+    if (arrays && object.texture0 != NULL)
+      object.texture0Array = object.texture0->getArray();
+    if (!arrays)
+      textures.removeAll(object.texture0);
+    textures.removeAll(object.texture1);
+    textures.removeAll(object.texture2);
+    textures.removeAll(object.texture3);
+    textures.removeAll(object.texture4);
+  }
+  renderer->releaseArraySources(textures);
+}
+
+// Ghosts and static bodies are pre-transformed into world space and merged per material,
+// objects marked nobatch in the .scene are left alone. Objects from the same geometry pool
+// share a vertex layout, which mergeMeshes requires.
+void BlenderScene::buildStaticBatches() {
+  QMap<QByteArray, QList<int> > groups;
+  for (int i = 0; i < objects.size(); ++i) {
+    const RenderableObject& object = objects.at(i);
+    if (!object.batchable || object.staticBatch || object.shader == NULL || object.mesh == NULL ||
+        !object.mesh->isLoaded() || !(object.ghost || object.body->isStaticObject()))
       continue;
 
-    if (ctx.frustumCulling && object.body != NULL) {
-      btVector3 aabbMin, aabbMax;
-      object.body->getAabb(aabbMin, aabbMax); // TODO: aabb caching?
+    const btVector3 origin = worldTransform(object).getOrigin();
+    const qint32 cell[3] = {
+      qint32(floor(origin.x() / STATIC_BATCH_CELL_SIZE)),
+      qint32(floor(origin.y() / STATIC_BATCH_CELL_SIZE)),
+      qint32(floor(origin.z() / STATIC_BATCH_CELL_SIZE))};
+    const void* state[7] = {object.shader, object.texture0, object.texture1, object.texture2,
+      object.texture3, object.texture4, object.meshPool()};
+
+    QByteArray key(reinterpret_cast<const char*>(state), sizeof(state));
+    key.append(reinterpret_cast<const char*>(cell), sizeof(cell));
+    key.append(object.transparent ? '1' : '0');
+    groups[key] << i;
+  }
 
-      if (!ctx.viewFrustum.containsAabb(aabbMin, aabbMax))
-        continue;
+  QVector<bool> merged(objects.size(), false);
+  QVector<RenderableObject> batches;
+  int nMerged = 0;
+  for (QMap<QByteArray, QList<int> >::const_iterator group = groups.constBegin(); group != groups.constEnd(); ++group) {
+    const QList<int>& members = group.value();
+    for (int first = 0; first < members.size(); ) {
+      QVector<const Mesh*> parts;
+      QVector<btTransform> transforms;
+      unsigned int nVertices = 0;
+      int last = first;
+      for (; last < members.size(); ++last) {
+        const RenderableObject& object = objects.at(members[last]);
+        if (!parts.isEmpty() && nVertices + object.mesh->getVertexCount() > MAX_STATIC_BATCH_VERTICES)
+          break;
+        parts << object.mesh;
+        transforms << worldTransform(object);
+        nVertices += object.mesh->getVertexCount();
+      }
+
+      if (parts.size() > 1) {
+        RenderableObject batch = objects.at(members[first]);
+        batch.mesh = renderer->mergeMeshes(parts, transforms);
+        batch.name = "static batch";
+        batch.body = NULL;
+        batch.ghost = true;
+        batch.staticBatch = true;
+        batch.transform.setIdentity();
+        batches << batch;
+        for (int i = first; i < last; ++i)
+          merged[members[i]] = true;
+        nMerged += parts.size();
+      }
+      first = last;
+    }
+  }
+
+  if (batches.isEmpty())
+    return;
+
+  QVector<RenderableObject> remaining;
+  remaining.reserve(objects.size() - nMerged + batches.size());
+  for (int i = 0; i < objects.size(); ++i) {
+    if (!merged[i])
+      remaining << objects.at(i);
+  }
+  objects = remaining + batches;
+  std::cout << "Merged " << nMerged << " static objects into " << batches.size() << " batches." << std::endl;
+}
+
+// Dense ids for the render queue keys, in order of first use. Meshes are numbered pool by
+// pool, so draws from one geometry pool end up next to each other.
+void BlenderScene::assignSortIds() {
+  QHash<const Shader*, quint32> shaderIds;
+  QHash<QByteArray, quint32> textureSetIds;
+  QList<QPair<const GeometryPool*, const Mesh*> > meshes;
+
+  for (int i = 0; i < objects.size(); ++i) {
+    RenderableObject& object = objects[i];
+    if (!shaderIds.contains(object.shader))
+      shaderIds.insert(object.shader, shaderIds.size());
+    object.shaderId = shaderIds.value(object.shader);
+
+    // Objects sharing a texture array have the same binding, whatever their layer.
+    const Texture* texture0 = object.texture0Array != NULL ? object.texture0Array : object.texture0;
+    const Texture* textures[5] = {texture0, object.texture1, object.texture2, object.texture3, object.texture4};
+    const QByteArray textureSet(reinterpret_cast<const char*>(textures), sizeof(textures));
+    if (!textureSetIds.contains(textureSet))
+      textureSetIds.insert(textureSet, textureSetIds.size());
+    object.textureSetId = textureSetIds.value(textureSet);
+
+    meshes << qMakePair(object.meshPool(), static_cast<const Mesh*>(object.mesh));
+  }
+
+  qSort(meshes.begin(), meshes.end());
+  for (int i = 0; i < objects.size(); ++i) {
+    RenderableObject& object = objects[i];
+    object.meshId = qLowerBound(meshes.begin(), meshes.end(), qMakePair(object.meshPool(), static_cast<const Mesh*>(object.mesh))) - meshes.begin();
+  }
+}
+
+// Objects that can be drawn with one instanced call.
+bool BlenderScene::sameBatch(const RenderableObject& a, const RenderableObject& b) {
+  return a.shaderId == b.shaderId && a.textureSetId == b.textureSetId && a.meshId == b.meshId &&
+    a.transparent == b.transparent;
+}
+
+// Everything about an object that stays the same between frames is worked out once, only
+// bodies that moved are refreshed. The list is rebuilt whenever objects are added or
+// removed or a mesh finishes loading (its bounds and position decode are known by then).
+// Meshes still loading draw nothing and are left out.
+void BlenderScene::buildCommands() {
+  deleteQueries();
+  commands.clear();
+  dynamicCommands.clear();
+  for (int i = 0; i < objects.size(); ++i) {
+    const RenderableObject& object = objects.at(i);
+    if (object.shader == NULL || object.mesh == NULL || !object.mesh->isLoaded())
+      continue;
+
+    if (object.body != NULL && !object.body->isStaticObject())
+      dynamicCommands << commands.size();
+    DrawCommand command;
+    command.object = i;
+    command.query = 0;
+    command.queryPending = false;
+    command.occluded = false;
+    command.queryFrame = command.resultFrame = 0;
+    commands << command;
+  }
+
+  QVector<btVector3> aabbMins(commands.size()), aabbMaxs(commands.size());
+  for (int i = 0; i < commands.size(); ++i)
+    updateCommand(i, aabbMins[i], aabbMaxs[i]);
+  commandTree.build(aabbMins, aabbMaxs);
+  commandsValid = true;
+}
+
+// Works out the instance data and the world bounds of a command.
+void BlenderScene::updateCommand(int index, btVector3& aabbMin, btVector3& aabbMax) {
+  DrawCommand& command = commands[index];
+  const RenderableObject& object = objects.at(command.object);
+  const btTransform transform = worldTransform(object);
+  command.transform = transform;
+  command.model = mat4(transform);
+  object.mesh->applyPositionTransform(command.model);
+  command.layer = object.texture0Array != NULL ? object.texture0->getLayer() : 0;
+
+  object.mesh->getAabb(transform, aabbMin, aabbMax);
+  command.aabbMin = aabbMin;
+  command.aabbMax = aabbMax;
+  // Batches sit at the origin, their bounds say where the geometry is.
+  command.position = object.staticBatch ? (aabbMin + aabbMax) * 0.5 : transform.getOrigin();
+}
+
+// Bullet only writes the motion states of bodies that are awake, everything else keeps
+// its command and its place in the tree.
+void BlenderScene::refreshMovedCommands() {
+  btVector3 aabbMin, aabbMax;
+  for (int i = 0; i < dynamicCommands.size(); ++i) {
+    const int index = dynamicCommands.at(i);
+    if (worldTransform(objects.at(commands.at(index).object)) == commands.at(index).transform)
+      continue;
+    updateCommand(index, aabbMin, aabbMax);
+    commandTree.update(index, aabbMin, aabbMax);
+  }
+}
+
+// Turns the commands commandTree.traverse hands out into render queue items. Leaves the
+// frustum only cuts are tested box by box with Frustum::cullBoxes. Commands a recent
+// occlusion query found hidden are counted instead of queued.
+class BlenderScene::CommandCollector {
+public:
+  CommandCollector(const BlenderScene& scene, const RenderContext& ctx, CullArena& arena)
+    : scene(scene), ctx(ctx), arena(arena) {
+    // Distance along the view direction, relative to the far plane.
+    const float* view = ctx.modelView.constData();
+    viewDepth.setValue(-view[2], -view[6], -view[10]);
+    viewDepthOffset = -view[14];
+  }
+
+  void inside(int first, int count) {
+    for (int p = first; p < first + count; ++p)
+      add(scene.commandTree.item(p));
+  }
+
+  void intersecting(int first, int count) {
+    quint32 visible[(Bvh::LEAF_SIZE + 31) / 32];
+    ctx.viewFrustum.cullBoxes(scene.commandTree.boxes(), first, count, visible);
+    for (int i = 0; i < count; ++i) {
+      if (visible[i / 32] & (1u << (i % 32)))
+        add(scene.commandTree.item(first + i));
+    }
+  }
+
+private:
+  void add(int index) {
+    const DrawCommand& command = scene.commands.at(index);
+    if (ctx.occlusionCulling && !nearEye(command)) {
+      const int frame = scene.frameNumber;
+      const bool hidden = command.occluded && frame - command.resultFrame <= OCCLUSION_MAX_AGE;
+      // Hidden commands are tested every frame, so they show up again as soon as possible.
+      if (!command.queryPending && (hidden || (frame + index) % OCCLUSION_REQUERY_INTERVAL == 0))
+        arena.queries << index;
+      if (hidden) {
+        ++arena.occluded;
+        return;
+      }
+    }
+
+    const RenderableObject& object = scene.objects.at(command.object);
+    const float depth = (viewDepth.dot(command.position) + viewDepthOffset) / SORT_DEPTH_RANGE;
+    RenderQueue::Item item;
+    item.key = RenderQueue::makeKey(0, object.transparent, object.shaderId, object.textureSetId, object.meshId, depth);
+    item.index = index;
+    arena.items << item;
+  }
+
+  bool nearEye(const DrawCommand& command) const {
+    const btScalar reach = OCCLUSION_BOX_MARGIN + OCCLUSION_NEAR_CLEARANCE;
+    for (int axis = 0; axis < 3; ++axis) {
+      if (scene.eye[axis] < command.aabbMin[axis] - reach || scene.eye[axis] > command.aabbMax[axis] + reach)
+        return false;
+    }
+    return true;
+  }
+
+  const BlenderScene& scene;
+  const RenderContext& ctx;
+  CullArena& arena;
+  btVector3 viewDepth;
+  btScalar viewDepthOffset;
+};
+
+// Adds the visible commands below cullRoots [firstRoot, lastRoot) to the arena. Runs on
+// worker threads, each with its own arena, the tree and the commands are only read.
+void BlenderScene::cullSubtrees(int firstRoot, int lastRoot, const RenderContext* ctx, CullArena* arena) const {
+  arena->items.clear();
+  arena->queries.clear();
+  arena->occluded = 0;
+  CommandCollector collector(*this, *ctx, *arena);
+  for (int r = firstRoot; r < lastRoot; ++r) {
+    if (ctx->frustumCulling)
+      commandTree.traverse(ctx->viewFrustum, collector, cullRoots.at(r));
+    else {
+      const Bvh::Node& root = commandTree.node(cullRoots.at(r));
+      collector.inside(root.first, root.count);
+    }
+  }
+}
+
+class BlenderScene::CullJob : public QRunnable {
+public:
+  CullJob(const BlenderScene& scene, int firstRoot, int lastRoot, const RenderContext& ctx, CullArena& arena)
+    : scene(scene), firstRoot(firstRoot), lastRoot(lastRoot), ctx(ctx), arena(arena) {}
+
+  void run() {
+    scene.cullSubtrees(firstRoot, lastRoot, &ctx, &arena);
+  }
+
+private:
+  const BlenderScene& scene;
+  int firstRoot, lastRoot;
+  const RenderContext& ctx;
+  CullArena& arena;
+};
+
+class BlenderScene::InstanceJob : public QRunnable {
+public:
+  InstanceJob(const BlenderScene& scene, int first, int last, GLfloat* instances)
+    : scene(scene), first(first), last(last), instances(instances) {}
+
+  void run() {
+    scene.writeInstances(first, last, instances);
+  }
+
+private:
+  const BlenderScene& scene;
+  int first, last;
+  GLfloat* instances;
+};
+
+// Instance data of the queued commands in [first, last), in queue order.
+void BlenderScene::writeInstances(int first, int last, GLfloat* instances) const {
+  for (int i = first; i < last; ++i) {
+    const DrawCommand& command = commands.at(queue.at(i).index);
+    GLfloat instance[INSTANCE_FLOATS];
+    memcpy(instance, command.model.constData(), 16 * sizeof(GLfloat));
+    instance[16] = command.layer;
+    instance[17] = instance[18] = instance[19] = 0;
+    memcpy(instances + i * INSTANCE_FLOATS, instance, sizeof(instance));
+  }
+}
+
+// Reads back the queries that have finished, without waiting for the others.
+void BlenderScene::collectOcclusionResults() {
+  for (int i = 0; i < pendingQueries.size(); ) {
+    DrawCommand& command = commands[pendingQueries.at(i)];
+    GLuint samples;
+    if (!renderer->queryResult(command.query, samples)) {
+      ++i;
+      continue;
+    }
+    command.queryPending = false;
+    command.occluded = samples == 0;
+    command.resultFrame = command.queryFrame;
+    pendingQueries[i] = pendingQueries.last();
+    pendingQueries.pop_back();
+  }
+}
+
+// Draws the bounds of the commands the culling threads picked against the depth buffer of
+// the frame, without touching it or the colors. Results are read in a later frame.
+void BlenderScene::issueOcclusionQueries(const RenderContext& ctx) {
+  renderer->setShader(occlusionShader);
+  renderer->setUniformMat4(UNIFORM_PROJ, ctx.projection);
+  renderer->setCapability(GL_DEPTH_TEST, true);
+  renderer->setDepthFunc(GL_LEQUAL);
+  renderer->setDepthMask(false);
+  renderer->setColorMask(false);
+
+  const btVector3 margin(OCCLUSION_BOX_MARGIN, OCCLUSION_BOX_MARGIN, OCCLUSION_BOX_MARGIN);
+  for (int t = 0; t < cullArenas.size(); ++t) {
+    const QVector<int>& queries = cullArenas.at(t).queries;
+    for (int i = 0; i < queries.size(); ++i) {
+      DrawCommand& command = commands[queries.at(i)];
+      if (command.query == 0)
+        command.query = renderer->createQuery();
+
+      const btVector3 center = (command.aabbMin + command.aabbMax) * 0.5;
+      const btVector3 extent = (command.aabbMax - command.aabbMin) * 0.5 + margin;
+      mat4 model;
+      model.translate(center.x(), center.y(), center.z());
+      model.scale(extent.x(), extent.y(), extent.z());
+      renderer->setUniformMat4(UNIFORM_MODEL_VIEW, ctx.modelView * model);
+
+      renderer->beginOcclusionQuery(command.query);
+      renderer->drawMesh(occlusionBox);
+      renderer->endOcclusionQuery();
+      command.queryPending = true;
+      command.queryFrame = frameNumber;
+      pendingQueries << queries.at(i);
     }
+  }
+
+  renderer->setColorMask(true);
+  renderer->setDepthMask(true);
+  renderer->setDepthFunc(GL_LESS);
+}
+
+void BlenderScene::deleteQueries() {
+  for (int i = 0; i < commands.size(); ++i) {
+    if (commands.at(i).query != 0)
+      renderer->deleteQuery(commands.at(i).query);
+  }
+  pendingQueries.clear();
+}
 
+const BlenderScene::RenderableObject& BlenderScene::queuedObject(int i) const {
+  return objects.at(commands.at(queue.at(i).index).object);
+}
+
+btTransform BlenderScene::worldTransform(const RenderableObject& object) const {
+  if (object.body == NULL)
+    return object.transform;
+  btTransform transform;
+  object.body->getMotionState()->getWorldTransform(transform);
+  return transform;
+}
+
+void BlenderScene::draw(qint64 delta, RenderContext& ctx) {
+  static const GLfloat bias[16] = {
+    0.5, 0.0, 0.0, 0.0,
+    0.0, 0.5, 0.0, 0.0,
+    0.0, 0.0, 0.5, 0.0,
+    0.5, 0.5, 0.5, 1.0};
+
+  FrameConstants frame;
+  memcpy(frame.proj, ctx.projection.constData(), sizeof(frame.proj));
+  memcpy(frame.view, ctx.modelView.constData(), sizeof(frame.view));
+  memcpy(frame.shadowProj, ctx.sunProjection.constData(), sizeof(frame.shadowProj));
+  memcpy(frame.shadowModelView, ctx.sunModelView.constData(), sizeof(frame.shadowModelView));
+  memcpy(frame.bias, bias, sizeof(bias));
+  frame.lightDir[0] = ctx.sunDirection.x();
+  frame.lightDir[1] = ctx.sunDirection.y();
+  frame.lightDir[2] = ctx.sunDirection.z();
+  frame.lightDir[3] = 0;
+  frame.camPosition[0] = ctx.camPosition.x();
+  frame.camPosition[1] = ctx.camPosition.y();
+  frame.camPosition[2] = ctx.camPosition.z();
+  frame.camPosition[3] = 1;
+  renderer->setFrameConstants(frame);
+
+  // TODO: this overrides sixth unit, make this more general
+  renderer->bindTexture(5, ctx.depthBuffer);
+
+  ctx.objectsDrawn = 0;
+  ctx.objectsOccluded = 0;
+
+  if (!commandsValid)
+    buildCommands();
+
+  refreshMovedCommands();
+  collectOcclusionResults();
+  ++frameNumber;
+  const mat4 viewInverse = ctx.modelView.inverted();
+  eye.setValue(viewInverse(0, 3), viewInverse(1, 3), viewInverse(2, 3));
+
+  // Culling and the instance data are split into parts for framePool, the first part is
+  // done here. Parts keep their order, so the result doesn't depend on the number of
+  // threads. Culling gets a few subtrees of the command tree per thread.
+  const int nThreads = qBound(1, commands.size() / MIN_COMMANDS_PER_THREAD, framePool.maxThreadCount() + 1);
+
+  commandTree.splitRoots(nThreads * 4, cullRoots);
+  cullArenas.resize(nThreads);
+  for (int t = 1; t < nThreads; ++t)
+    framePool.start(new CullJob(*this, cullRoots.size() * t / nThreads,
+      cullRoots.size() * (t + 1) / nThreads, ctx, cullArenas[t]));
+  cullSubtrees(0, cullRoots.size() / nThreads, &ctx, &cullArenas[0]);
+  framePool.waitForDone();
+
+  queue.clear();
+  for (int t = 0; t < nThreads; ++t) {
+    queue.append(cullArenas.at(t).items);
+    ctx.objectsOccluded += cullArenas.at(t).occluded;
+  }
+  queue.sort();
+
+  GLfloat* instances = renderer->allocateInstanceData(queue.size());
+  for (int t = 1; t < nThreads; ++t)
+    framePool.start(new InstanceJob(*this, queue.size() * t / nThreads, queue.size() * (t + 1) / nThreads, instances));
+  writeInstances(0, queue.size() / nThreads, instances);
+  framePool.waitForDone();
+  renderer->commitInstanceData();
+
+  ctx.drawCalls = 0;
+  for (int i = 0; i < queue.size(); ) {
+    const RenderableObject& object = queuedObject(i);
+    const bool instanced = renderer->isInstanced(object.shader);
+
+    // The queue puts objects with the same state next to each other.
+    int count = 1;
+    while (instanced && i + count < queue.size() && sameBatch(object, queuedObject(i + count)))
+      ++count;
+
+    // Left as is for the next object, translucent draws all come at the end.
+    renderer->setCapability(GL_ALPHA_TEST, object.transparent);
     if (object.transparent) {
       //glEnable(GL_BLEND);
       //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
       //glEnable(GL_SAMPLE_ALPHA_TO_COVERAGE);
-      glEnable(GL_ALPHA_TEST);
-      glAlphaFunc(GL_GREATER, 0.5f);
+      renderer->setAlphaFunc(GL_GREATER, 0.5f);
     }
 
     renderer->setShader(object.shader);
+    renderer->setSampler(UNIFORM_DEPTH, 5);
 
-    if (object.texture0 != NULL)
-      renderer->setTexture("texture0", object.texture0, 0);
+    if (object.texture0Array != NULL)
+      renderer->setTexture(UNIFORM_TEXTURES[0], object.texture0Array, 0);
+    else if (object.texture0 != NULL)
+      renderer->setTexture(UNIFORM_TEXTURES[0], object.texture0, 0);
     if (object.texture1 != NULL)
-      renderer->setTexture("texture1", object.texture1, 1);
+      renderer->setTexture(UNIFORM_TEXTURES[1], object.texture1, 1);
     if (object.texture2 != NULL)
-      renderer->setTexture("texture2", object.texture2, 2);
+      renderer->setTexture(UNIFORM_TEXTURES[2], object.texture2, 2);
     if (object.texture3 != NULL)
-      renderer->setTexture("texture3", object.texture3, 3);
+      renderer->setTexture(UNIFORM_TEXTURES[3], object.texture3, 3);
     if (object.texture4 != NULL)
-      renderer->setTexture("texture4", object.texture4, 4);
-
-    mat4 modelViewTop = ctx.modelView;
-    mat4 model;
+      renderer->setTexture(UNIFORM_TEXTURES[4], object.texture4, 4);
 
-    if (object.body != NULL) {
-      btMotionState* state = object.body->getMotionState();
-      btTransform transform;
-      btScalar matrix[16];
-      state->getWorldTransform(transform);
-      transform.getOpenGLMatrix(matrix);
-      modelViewTop *= toMat4(matrix);
-      model *= toMat4(matrix);
-    }
+    if (instanced)
+      renderer->drawMeshInstanced(object.mesh, i, count);
     else {
-      btScalar matrix[16];
-      object.transform.getOpenGLMatrix(matrix);
-      modelViewTop *= toMat4(matrix);
-      model *= toMat4(matrix);
-    }
-
-    // TODO: this overrides sixth unit, make this more general
-    glActiveTexture(GL_TEXTURE0 + 5);
-    glBindTexture(GL_TEXTURE_2D, ctx.depthBuffer);
-    renderer->setUniform1i("depth", 5);
-    renderer->setUniform4fv("bias", bias);
-    renderer->setUniformMat4("shadowProj", ctx.sunProjection);
-    renderer->setUniformMat4("shadowModelView", ctx.sunModelView);
-
-    renderer->setUniform3f("light_dir", ctx.sunDirection);
-    renderer->setUniformMat4("proj", ctx.projection);
-    renderer->setUniformMat4("modelView", modelViewTop);
-    renderer->setUniformMat4("model", model);
-    renderer->drawMesh(object.mesh);
+      const mat4& model = commands.at(queue.at(i).index).model;
+      const mat4 modelViewTop = ctx.modelView * model;
 
-    if (object.transparent) {
-      glDisable(GL_ALPHA_TEST);
-      //glDisable(GL_BLEND);
-      //glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+      renderer->setUniformMat4(UNIFORM_MODEL_VIEW, modelViewTop);
+      renderer->setUniformMat4(UNIFORM_MODEL, model);
+      renderer->drawMesh(object.mesh);
     }
 
-    ctx.objectsDrawn++;
+    ctx.objectsDrawn += count;
+    ctx.drawCalls++;
+    i += count;
   }
 
+  renderer->setCapability(GL_ALPHA_TEST, false);
+  //glDisable(GL_BLEND);
+  //glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+
+  // Tested against everything drawn so far, the result decides about the next frames.
+  issueOcclusionQueries(ctx);
+
   // TODO: diagnostics
 }
 
@@ -1227,64 +3707,66 @@ void App::drawVehicle(RenderContext& ctx, mat4& modelView, bool shadow) {
   mat4 model; // Local transform.
 
   // Truck.
-  btScalar matrix[16];
   btTransform worldTransform = vehicle->getChassisWorldTransform();
   worldTransform.setOrigin(chassisPos);
-  worldTransform.getOpenGLMatrix(matrix);
-  modelViewTop *= toMat4(matrix);
-  modelViewTop.rotate(180, vec3(0,0,1));
-  modelViewTop.scale(0.35, 0.35, 0.35);
-
-  model *= toMat4(matrix);
+  model = mat4(worldTransform);
   model.rotate(180, vec3(0,0,1));
   model.scale(0.35, 0.35, 0.35);
+  modelViewTop *= model;
 
   if (shadow) {
-    renderer->setUniformMat4("proj", ctx.sunProjection);
+    renderer->setUniformMat4(UNIFORM_PROJ, ctx.sunProjection);
   }
   else {
-    renderer->setUniformMat4("proj", ctx.projection);
-    renderer->setUniform3f("cam_pos", ctx.camPosition);
-    renderer->setUniform3f("light_dir", ctx.sunDirection);
-    renderer->setTexture("sky", envCubemap, 0);
-    renderer->setTexture("texture0", carTexture, 1);
+    renderer->setUniformMat4(UNIFORM_PROJ, ctx.projection);
+    renderer->setUniform3f(UNIFORM_CAM_POS, ctx.camPosition);
+    renderer->setUniform3f(UNIFORM_LIGHT_DIR, ctx.sunDirection);
+    renderer->setTexture(UNIFORM_SKY, envCubemap, 0);
+    renderer->setTexture(UNIFORM_TEXTURES[0], carTexture, 1);
   }
 
-  renderer->setUniformMat4("modelView", modelViewTop);
-  renderer->setUniformMat4("model", model);
+  mat4 meshModelView = modelViewTop;
+  mat4 meshModel = model;
+  truck->applyPositionTransform(meshModelView);
+  truck->applyPositionTransform(meshModel);
+  renderer->setUniformMat4(UNIFORM_MODEL_VIEW, meshModelView);
+  renderer->setUniformMat4(UNIFORM_MODEL, meshModel);
+  if (!shadow)
+    renderer->setUniform2f(UNIFORM_HEIGHT_DECODE, truck->positionZDecode());
   renderer->drawMesh(truck);
 
   // Chassis.
+  meshModelView = modelViewTop;
+  meshModel = model;
+  chassisMesh->applyPositionTransform(meshModelView);
+  chassisMesh->applyPositionTransform(meshModel);
+
   if (!shadow) {
     renderer->setShader(chassisShader);
-    renderer->setUniformMat4("proj", ctx.projection);
-    renderer->setUniform3f("light_dir", ctx.sunDirection);
-    renderer->setUniformMat4("modelView", modelViewTop);
-    renderer->setUniformMat4("model", model);
+    renderer->setUniformMat4(UNIFORM_PROJ, ctx.projection);
+    renderer->setUniform3f(UNIFORM_LIGHT_DIR, ctx.sunDirection);
   }
 
+  renderer->setUniformMat4(UNIFORM_MODEL_VIEW, meshModelView);
+  renderer->setUniformMat4(UNIFORM_MODEL, meshModel);
   renderer->drawMesh(chassisMesh);
 
   // Wheels.
   if (!shadow) {
     renderer->setShader(tyre);
-    renderer->setTexture("texture", wheelTexture, 0);
-    renderer->setUniform3f("light_dir", ctx.sunDirection);
-    renderer->setUniformMat4("proj", ctx.projection);
+    renderer->setTexture(UNIFORM_TEXTURE, wheelTexture, 0);
+    renderer->setUniform3f(UNIFORM_LIGHT_DIR, ctx.sunDirection);
+    renderer->setUniformMat4(UNIFORM_PROJ, ctx.projection);
   }
 
   for (int i = 0; i < vehicle->getNumWheels(); ++i) {
-    vehicle->getWheelInfo(i).m_worldTransform.getOpenGLMatrix(matrix);
-    modelViewTop = modelView;
-    modelViewTop *= toMat4(matrix);
-    modelViewTop.scale(0.4, 0.3, 0.3);
-
-    model.setToIdentity();
-    model *= toMat4(matrix);
+    model = mat4(vehicle->getWheelInfo(i).m_worldTransform);
     model.scale(0.4, 0.3, 0.3);
+    wheel->applyPositionTransform(model);
+    modelViewTop = modelView * model;
 
-    renderer->setUniformMat4("modelView", modelViewTop);
-    renderer->setUniformMat4("model", model);
+    renderer->setUniformMat4(UNIFORM_MODEL_VIEW, modelViewTop);
+    renderer->setUniformMat4(UNIFORM_MODEL, model);
     renderer->drawMesh(wheel);
   }
 }
@@ -1293,13 +3775,22 @@ void App::paintGL() {
   qint64 delta = timer->restart();
   updatePhysics(delta);
 
+  renderer->beginFrame();
+  try {
+    renderer->processLoadedAssets();
+  } catch (load_exception& e) {
+    std::cout << "Exception: " << e.what() << std::endl;
+    this->parentWidget()->close();
+    return;
+  }
+
   if (shadows) {
     glBindFramebuffer(GL_FRAMEBUFFER, shadowFbo);
     glPushAttrib(GL_VIEWPORT_BIT);
     glViewport(0,0, SHADOWMAP_WIDTH, SHADOWMAP_HEIGHT);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
-    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    renderer->setCapability(GL_DEPTH_TEST, true);
+    renderer->setColorMask(false);
 
     mat4 sunModelView;
     vec3 center = btToQt(vehicle->getChassisWorldTransform().getOrigin());
@@ -1313,7 +3804,7 @@ void App::paintGL() {
 
     glPopAttrib();
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    renderer->setColorMask(true);
   }
 
   if (blurEnabled) {
@@ -1322,7 +3813,7 @@ void App::paintGL() {
     glViewport(0,0, RTT_WIDTH, RTT_HEIGHT);
   }
 
-  glEnable(GL_DEPTH_TEST);
+  renderer->setCapability(GL_DEPTH_TEST, true);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   mat4 modelView;
 
@@ -1364,18 +3855,16 @@ void App::paintGL() {
     glLoadIdentity();
 
     //glDepthMask(GL_FALSE);
-    glDisable(GL_DEPTH_TEST);
+    renderer->setCapability(GL_DEPTH_TEST, false);
 
     renderer->setShader(blur);
     renderer->setUniformMat4("previousModelView", previousModelView);
     renderer->setUniformMat4("proj", ctx.projection);
     renderer->setUniformMat4("modelViewInverse", ctx.modelView.inverted());
     renderer->setUniformMat4("projInverse", ctx.projection.inverted());
-    glActiveTexture(GL_TEXTURE0 + 0);
-    glBindTexture(GL_TEXTURE_2D, colorBuffer);
+    renderer->bindTexture(0, colorBuffer);
     renderer->setUniform1i("color", 0);
-    glActiveTexture(GL_TEXTURE0 + 1);
-    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    renderer->bindTexture(1, depthTexture);
     renderer->setUniform1i("depth", 1);
 
     glBegin(GL_QUADS);
@@ -1387,16 +3876,16 @@ void App::paintGL() {
   }
 
   renderer->disableShaders();
-  glEnable(GL_DEPTH_TEST);
+  renderer->setCapability(GL_DEPTH_TEST, true);
   //glDepthMask(GL_FALSE);
-  glActiveTexture(GL_TEXTURE0); // This line was added after hours of painful debugging.
+  renderer->setActiveTextureUnit(0); // This line was added after hours of painful debugging.
   glColor4f(1,1,1,1);
 
   if (drawDebugInfo) {
     // TODO: convert this crap to shader based.
     if (stipple) {
-      glDisable(GL_DEPTH_TEST);
-      glEnable(GL_LINE_STIPPLE);
+      renderer->setCapability(GL_DEPTH_TEST, false);
+      renderer->setCapability(GL_LINE_STIPPLE, true);
       glLineStipple(1, 0x00FF);
     }
 
@@ -1410,8 +3899,8 @@ void App::paintGL() {
 
     if (stipple) {
       // Second pass for visible edges.
-      glEnable(GL_DEPTH_TEST);
-      glDisable(GL_LINE_STIPPLE);
+      renderer->setCapability(GL_DEPTH_TEST, true);
+      renderer->setCapability(GL_LINE_STIPPLE, false);
       dynamicsWorld->debugDrawWorld();
     }
   }
@@ -1422,6 +3911,10 @@ void App::paintGL() {
     glColor3f(0,0,0);
     renderText(width()-150, 10, "The Fps: " + fps, infoFont);
     renderText(width()-150, 20, "Objects drawn: " + QString("%1").arg(ctx.objectsDrawn), infoFont);
+    renderText(width()-150, 30, "Objects occluded: " + QString("%1").arg(ctx.objectsOccluded), infoFont);
+    renderText(width()-150, 40, "Draw calls: " + QString("%1").arg(ctx.drawCalls), infoFont);
+    const Renderer::StateCounters& counters = renderer->stateCounters();
+    renderText(width()-150, 50, QString("State calls: %1 (%2 skipped)").arg(counters.issued).arg(counters.skipped), infoFont);
   }
 
   if (state == Counting) {
@@ -1433,7 +3926,8 @@ void App::paintGL() {
   }
 
   if (state == App::Racing) { // TODO: use textures to draw HUD instead
-    glDisable(GL_DEPTH_TEST);
+    renderer->invalidateState(); // After the renderText calls above.
+    renderer->setCapability(GL_DEPTH_TEST, false);
     renderer->disableShaders();
     glViewport(0,0, this->width(), this->height());
     glMatrixMode(GL_PROJECTION);
@@ -1442,11 +3936,11 @@ void App::paintGL() {
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    renderer->setCapability(GL_BLEND, true);
+    renderer->setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     int deliX = 140;
-    glBindTexture(GL_TEXTURE_2D, 0);
+    renderer->bindTexture(0, 0);
     glColor4f(0.6,0,0, 0.8);
     glBegin(GL_QUADS);
     glVertex2f(45, height()-25);
@@ -1468,16 +3962,17 @@ void App::paintGL() {
     int seconds = (elapsed % 60000) / 1000;
     int mili = elapsed % 100;
     glColor3f(1,1,1);
-    glDisable(GL_BLEND);
+    renderer->setCapability(GL_BLEND, false);
     renderText(50, 50, QString("Time %1:%2:%3").arg(minutes, 2, 10, QChar('0'))
       .arg(seconds, 2, 10, QChar('0'))
       .arg(mili, 2, 10, QChar('0')),
       timeFont);
 
-    glActiveTexture(GL_TEXTURE0 + 0);
-    glEnable(GL_BLEND);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, speedometerBack->getID());
+    // renderText draws through Qt's own GL code, which the cache doesn't see.
+    renderer->invalidateState();
+    renderer->setCapability(GL_BLEND, true);
+    renderer->setCapability(GL_TEXTURE_2D, true);
+    renderer->bindTexture(0, speedometerBack->getID());
 
     int size = 200;
     glColor3f(1,1,1);
@@ -1489,7 +3984,7 @@ void App::paintGL() {
     glTexCoord2f(1,0); glVertex2f(size, 0);
     glEnd();
 
-    glBindTexture(GL_TEXTURE_2D, speedometerFront->getID());
+    renderer->bindTexture(0, speedometerFront->getID());
 
     glLoadIdentity();
     glTranslatef(width()-220, 30, 0);
@@ -1504,8 +3999,8 @@ void App::paintGL() {
     glTexCoord2f(1,0); glVertex2f(size, 0);
     glEnd();
 
-    glDisable(GL_BLEND);
-    glEnable(GL_DEPTH_TEST);
+    renderer->setCapability(GL_BLEND, false);
+    renderer->setCapability(GL_DEPTH_TEST, true);
 
     btVector3 goalPos(10, -70, 0); // TODO: rather find aabb
     if ((chassisPos*btVector3(1,1,0) - goalPos).length() < 20) {
@@ -1596,6 +4091,9 @@ void App::keyPressEvent(QKeyEvent* event) {
     case Qt::Key_O:
       ctx.frustumCulling = !ctx.frustumCulling;
       break;
+    case Qt::Key_K:
+      ctx.occlusionCulling = !ctx.occlusionCulling;
+      break;
     case Qt::Key_F1:
       grabFrameBuffer().save("screenshot.jpg", 0, 95);
       break;
@@ -1687,13 +4185,10 @@ void DebugDrawer::setModelViewProj(mat4& modelView, mat4& proj) {
 
   // TODO: hmmm...
   glMatrixMode(GL_PROJECTION);
-  GLfloat mat[16];
-  for (int i = 0; i < 16; ++i) mat[i] = proj.data()[i];
-  glLoadMatrixf(mat);
+  glLoadMatrixf(proj.constData());
 
   glMatrixMode(GL_MODELVIEW);
-  for (int i = 0; i < 16; ++i) mat[i] = modelView.data()[i];
-  glLoadMatrixf(mat);
+  glLoadMatrixf(modelView.constData());
 }
 
 void DebugDrawer::drawLine(const btVector3& from,const btVector3& to,const btVector3& fromColor, const btVector3& toColor) {
@@ -1758,7 +4253,80 @@ void ConfigurationWindow::addPointerValue(const char* name, float* var, float mi
   mainLayout->addWidget(slider, 0,1);
 }
 
+// Times Frustum::cullBoxes and a Bvh query against per box containsAabb calls on random
+// boxes around a camera and checks that they agree. Run with --benchmark-culling, no
+// window is opened.
+int benchmarkCulling() {
+  mat4 projection, view;
+  projection.perspective(60, 4. / 3., 0.1, 1000.);
+  view.lookAt(QVector3D(0, 0, 0), QVector3D(1, 0.2, 0.5), QVector3D(0, 1, 0));
+  const Frustum frustum((projection * view).transposed());
+
+  const int sizes[] = { 300, 10000, 100000 };
+  for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const int n = sizes[s];
+    const int repeats = qMax(1, 10000000 / n);
+    quint32 seed = 12345;
+    QVector<btVector3> mins(n), maxs(n);
+    BoxArray boxes;
+    boxes.resize(n);
+    for (int i = 0; i < n; ++i) {
+      btVector3 center, extent;
+      for (int axis = 0; axis < 3; ++axis) {
+        seed = seed * 1664525u + 1013904223u;
+        center[axis] = (seed >> 8) / float(1 << 24) * 1000 - 500;
+        seed = seed * 1664525u + 1013904223u;
+        extent[axis] = 0.5f + (seed >> 8) / float(1 << 24) * 4.5f;
+      }
+      mins[i] = center - extent;
+      maxs[i] = center + extent;
+      boxes.set(i, mins[i], maxs[i]);
+    }
+
+    QVector<quint32> visible((n + 31) / 32);
+    QVector<bool> contained(n, false);
+    QElapsedTimer timer;
+    timer.start();
+    for (int r = 0; r < repeats; ++r)
+      frustum.cullBoxes(boxes, 0, n, visible.data());
+    const qint64 batchNs = timer.nsecsElapsed();
+
+    timer.restart();
+    for (int r = 0; r < repeats; ++r)
+      for (int i = 0; i < n; ++i)
+        contained[i] = frustum.containsAabb(mins[i], maxs[i]);
+    const qint64 singleNs = timer.nsecsElapsed();
+
+    Bvh bvh;
+    bvh.build(mins, maxs);
+    QVector<int> found;
+    timer.restart();
+    for (int r = 0; r < repeats; ++r) {
+      found.clear();
+      bvh.query(frustum, found);
+    }
+    const qint64 treeNs = timer.nsecsElapsed();
+
+    int nVisible = 0, mismatches = 0;
+    QVector<bool> inTree(n, false);
+    for (int i = 0; i < found.size(); ++i)
+      inTree[found.at(i)] = true;
+    for (int i = 0; i < n; ++i) {
+      const bool batched = (visible[i / 32] >> (i % 32)) & 1;
+      nVisible += contained[i];
+      mismatches += batched != contained[i] || inTree[i] != contained[i];
+    }
+    std::cout << n << " boxes (" << nVisible << " visible): cullBoxes " << double(batchNs) / (double(repeats) * n)
+              << " ns/box, containsAabb " << double(singleNs) / (double(repeats) * n) << " ns/box, Bvh "
+              << double(treeNs) / (double(repeats) * n) << " ns/box, " << mismatches << " mismatches" << std::endl;
+  }
+  return 0;
+}
+
 int main(int argc, char** args) {
+  if (argc > 1 && strcmp(args[1], "--benchmark-culling") == 0)
+    return benchmarkCulling();
+
   int ret = setpriority(PRIO_PROCESS, getpid(), -20); // TODO: this doesn't seem to have any effect. Of course it doesn't, it's the only process (almost).
   std::cout << "Changed priority to -20: " << (ret == 0) << std::endl;
 
@@ -3,6 +3,7 @@
 #include <QWidget>
 #include <QtOpenGL>
 #include <QElapsedTimer>
+#include <QThreadPool>
 
 #include <btBulletDynamicsCommon.h>
 #include <BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h>
@@ -11,29 +12,44 @@
 
 #include <vehicle/btRaycastVehicle.h>
 
+#include <RenderQueue.h>
+#include <Bvh.h>
+#include <Matrix4.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 const QString HIGHSCORE_FILENAME = "highscore";
+const QString PROGRAM_CACHE_DIR = "shadercache";
 const int WIN_WIDTH = 800;
 const int WIN_HEIGHT = 600;
 const int RTT_WIDTH = 800;
 const int RTT_HEIGHT = 600;
 const int SHADOWMAP_WIDTH = 512;
 const int SHADOWMAP_HEIGHT = 512;
+const float NEAR_PLANE = 0.5f;
+const float FAR_PLANE = 900;
 
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
 
 class FirstPersonCamera;
 class Renderer;
 class Mesh;
+class GeometryPool;
 class VertexBuffer;
 class IndexBuffer;
 class Shader;
 class Texture;
+class Pack;
 class ConfigurationWindow;
 
 typedef QVector2D vec2;
 typedef QVector3D vec3;
 typedef QVector4D vec4;
-typedef QMatrix4x4 mat4;
+typedef Matrix4 mat4;
 
 class DebugDrawer : public btIDebugDraw {
 private:
@@ -63,7 +79,7 @@ public:
   };
  
   void update(const mat4& mvp) {
-    const qreal* data = mvp.constData();
+    const float* data = mvp.constData();
     planes[FrustumLeft  ] = Plane(data[12] - data[0], data[13] - data[1], data[14] - data[2],  data[15] - data[3]);
     planes[FrustumRight ] = Plane(data[12] + data[0], data[13] + data[1], data[14] + data[2],  data[15] + data[3]);
 
@@ -74,7 +90,7 @@ public:
     planes[FrustumNear  ] = Plane(data[12] + data[8], data[13] + data[9], data[14] + data[10], data[15] + data[11]);
   }
 
-  bool containsAabb(const btVector3& aabbMin, const btVector3& aabbMax) {
+  bool containsAabb(const btVector3& aabbMin, const btVector3& aabbMax) const {
     float minX = aabbMin.x();
     float minY = aabbMin.y();
     float minZ = aabbMin.z();
@@ -96,6 +112,85 @@ public:
     return true;
   }
 
+  // Same test as cullBoxes for one box, also telling whether it's completely inside, which
+  // is what Bvh::traverse needs to accept whole subtrees.
+  Bvh::Containment classifyAabb(const btVector3& aabbMin, const btVector3& aabbMax) const {
+    const btVector3 center = (aabbMin + aabbMax) * 0.5;
+    const btVector3 extent = (aabbMax - aabbMin) * 0.5;
+    Bvh::Containment result = Bvh::Inside;
+    for (int i = 0; i < 6; ++i) {
+      const btScalar d = planes[i].dist(center);
+      const btScalar r = planes[i].normal.absolute().dot(extent);
+      if (d + r <= 0)
+        return Bvh::Outside;
+      if (d - r <= 0)
+        result = Bvh::Intersecting;
+    }
+    return result;
+  }
+
+  // Tests boxes [first, first + n) of the array and sets bit i of visible (32 boxes per
+  // word) for each box i of the range that is at least partly inside, bits past the
+  // range end up cleared. A box is outside if it's behind a plane even at its farthest
+  // corner along the plane normal: dot(normal, center) + dot(|normal|, extent) + offset <= 0.
+  void cullBoxes(const BoxArray& boxes, int first, int n, quint32* visible) const {
+    memset(visible, 0, (n + 31) / 32 * sizeof(quint32));
+    const float* cx = boxes.centers[0].constData() + first;
+    const float* cy = boxes.centers[1].constData() + first;
+    const float* cz = boxes.centers[2].constData() + first;
+    const float* ex = boxes.extents[0].constData() + first;
+    const float* ey = boxes.extents[1].constData() + first;
+    const float* ez = boxes.extents[2].constData() + first;
+
+#if defined(__AVX__)
+    for (int i = 0; i < n; i += 8) {
+      __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+      for (int p = 0; p < 6; ++p) {
+        const Plane& plane = planes[p];
+        __m256 d = _mm256_set1_ps(plane.offset);
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.normal.x()), _mm256_loadu_ps(cx + i)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.normal.y()), _mm256_loadu_ps(cy + i)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.normal.z()), _mm256_loadu_ps(cz + i)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(btFabs(plane.normal.x())), _mm256_loadu_ps(ex + i)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(btFabs(plane.normal.y())), _mm256_loadu_ps(ey + i)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(btFabs(plane.normal.z())), _mm256_loadu_ps(ez + i)));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ));
+      }
+      visible[i / 32] |= quint32(_mm256_movemask_ps(inside)) << (i % 32);
+    }
+#elif defined(__SSE__)
+    for (int i = 0; i < n; i += 4) {
+      __m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+      for (int p = 0; p < 6; ++p) {
+        const Plane& plane = planes[p];
+        __m128 d = _mm_set1_ps(plane.offset);
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.normal.x()), _mm_loadu_ps(cx + i)));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.normal.y()), _mm_loadu_ps(cy + i)));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.normal.z()), _mm_loadu_ps(cz + i)));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(btFabs(plane.normal.x())), _mm_loadu_ps(ex + i)));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(btFabs(plane.normal.y())), _mm_loadu_ps(ey + i)));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(btFabs(plane.normal.z())), _mm_loadu_ps(ez + i)));
+        inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, _mm_setzero_ps()));
+      }
+      visible[i / 32] |= quint32(_mm_movemask_ps(inside)) << (i % 32);
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+      bool inside = true;
+      for (int p = 0; p < 6 && inside; ++p) {
+        const Plane& plane = planes[p];
+        inside = plane.offset + plane.normal.x() * cx[i] + plane.normal.y() * cy[i] + plane.normal.z() * cz[i] +
+          btFabs(plane.normal.x()) * ex[i] + btFabs(plane.normal.y()) * ey[i] + btFabs(plane.normal.z()) * ez[i] > 0;
+      }
+      if (inside)
+        visible[i / 32] |= 1u << (i % 32);
+    }
+#endif
+
+    if (n % 32 != 0)
+      visible[n / 32] &= (1u << (n % 32)) - 1;
+  }
+
 private:
   enum FrustumPlane {
     FrustumLeft = 0,
@@ -136,15 +231,33 @@ struct RenderContext {
   GLuint depthBuffer;
   Frustum viewFrustum;
   bool frustumCulling;
+  bool occlusionCulling;
   int objectsDrawn;
+  int objectsOccluded; // In the frustum but hidden, not counted in objectsDrawn.
+  int drawCalls;
+};
+
+// Notified by the Renderer on the GL thread as requested assets finish loading.
+class AssetListener {
+public:
+  virtual ~AssetListener() {}
+
+  virtual void textureLoaded(Texture* /*texture*/) {}
+  virtual void meshLoaded(Mesh* /*mesh*/) {}
+  // The asset couldn't be decoded, a texture keeps its placeholder and a mesh never draws.
+  virtual void assetFailed(const QString& /*fileName*/, const QString& /*error*/) {}
+  virtual void assetsLoaded() {} // Nothing this listener requested is pending anymore.
 };
 
-class BlenderScene {
+class BlenderScene : public AssetListener {
 public:
   BlenderScene(const char* fileName, btDynamicsWorld* world, Renderer* renderer);
   ~BlenderScene();
 
   void draw(qint64 delta, RenderContext& ctx);
+  virtual void meshLoaded(Mesh* mesh);
+  virtual void assetFailed(const QString& fileName, const QString& error);
+  virtual void assetsLoaded();
 
 private:
   struct RenderableObject {
@@ -155,15 +268,18 @@ private:
       texture2 = NULL;
       texture3 = NULL;
       texture4 = NULL;
+      texture0Array = NULL;
       shader = NULL;
       body = NULL;
+      name = "";
       ghost = false;
       transparent = false;
+      batchable = true;
+      staticBatch = false;
+      shaderId = textureSetId = meshId = 0;
     }
 
-    bool operator < (const BlenderScene::RenderableObject& other) const {
-      return shader < other.shader; // Comparing addresses (really simple way to sort objects by shaders).
-    }
+    const GeometryPool* meshPool() const;
 
     Mesh* mesh;
     Texture* texture0;
@@ -171,18 +287,82 @@ private:
     Texture* texture2;
     Texture* texture3;
     Texture* texture4;
+    Texture* texture0Array; // Bound instead of texture0 if the shader samples an array.
     Shader* shader;
     btRigidBody* body;
-    QString name;
+    const char* name; // Points into sceneData.
     bool ghost;
     bool transparent;
+    bool batchable;   // May be merged into a static batch if it never moves.
+    bool staticBatch; // Merged geometry in world space.
     btTransform transform;
+    quint32 shaderId, textureSetId, meshId; // For the render queue keys.
   };
 
+  // What draw needs of a drawable object, recorded once (see buildCommands).
+  struct DrawCommand {
+    int object; // Index into objects.
+    btTransform transform; // The one model and the bounds were worked out for.
+    btVector3 position; // Where the depth in the sort key is measured.
+    mat4 model; // Position decode included.
+    GLfloat layer;
+    btVector3 aabbMin, aabbMax; // World bounds, drawn as the occlusion query proxy.
+    GLuint query; // 0 until the command is first tested for occlusion.
+    bool queryPending;
+    bool occluded; // What the last finished query found.
+    int queryFrame; // When the pending or last finished query was issued.
+    int resultFrame; // When the query occluded is from was issued.
+  };
+
+  // What one culling thread hands back, reused every frame.
+  struct CullArena {
+    QVector<RenderQueue::Item> items;
+    QVector<int> queries; // Commands to test for occlusion.
+    int occluded;
+  };
+
+  class CommandCollector;
+  class CullJob;
+  class InstanceJob;
+
+  void buildCommands();
+  void updateCommand(int index, btVector3& aabbMin, btVector3& aabbMax);
+  void refreshMovedCommands();
+  void cullSubtrees(int firstRoot, int lastRoot, const RenderContext* ctx, CullArena* arena) const;
+  void collectOcclusionResults();
+  void issueOcclusionQueries(const RenderContext& ctx);
+  void deleteQueries();
+  void writeInstances(int first, int last, GLfloat* instances) const;
+  const RenderableObject& queuedObject(int i) const;
+  void buildTextureArrays();
+  void buildStaticBatches();
+  void assignSortIds();
+  btTransform worldTransform(const RenderableObject& object) const;
+  static bool sameBatch(const RenderableObject& a, const RenderableObject& b);
+  Texture* loadTexture(const Pack& pack, const QString& path, const QString& name);
+  Mesh* loadMesh(const Pack& pack, const QString& path, const QString& name);
+  Shader* loadShader(const Pack& pack, const QString& path, const QString& name);
+
   btBulletWorldImporter* importer;
   btDynamicsWorld* world;
   Renderer* renderer;
-  QList<RenderableObject> objects;
+  QByteArray sceneData;
+  QVector<RenderableObject> objects;
+  QVector<DrawCommand> commands;
+  Bvh commandTree; // World bounds of the commands, items are indices into commands.
+  QVector<int> dynamicCommands; // Commands of bodies that can move.
+  QVector<int> cullRoots; // Subtrees of commandTree shared out to the culling threads.
+  bool commandsValid;
+  RenderQueue queue; // Indices into commands.
+  QVector<CullArena> cullArenas; // One per culling thread.
+  // Culling and instance writing only, so they never queue behind asset decoding on the
+  // global pool while the GL thread waits for them.
+  QThreadPool framePool;
+  QVector<int> pendingQueries; // Commands whose query result hasn't been read yet.
+  Shader* occlusionShader;
+  Mesh* occlusionBox;
+  btVector3 eye; // Camera position of the frame being drawn.
+  int frameNumber;
 };
 
 class App : public QGLWidget {
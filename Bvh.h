@@ -0,0 +1,347 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+
+// Axis aligned boxes as centres and half extents in structure of arrays form, the layout
+// Frustum::cullBoxes wants. Storage is padded by a whole SIMD vector past the end, so
+// a range of boxes can be tested from any first box.
+class BoxArray {
+public:
+  static const int LANES = 8;
+
+  BoxArray() {
+    count = 0;
+  }
+
+  void resize(int n) {
+    count = n;
+    const int padded = (n + 2 * LANES - 1) / LANES * LANES;
+    for (int axis = 0; axis < 3; ++axis) {
+      centers[axis].resize(padded);
+      extents[axis].resize(padded);
+    }
+  }
+
+  void set(int i, const btVector3& aabbMin, const btVector3& aabbMax) {
+    for (int axis = 0; axis < 3; ++axis) {
+      centers[axis][i] = (aabbMin[axis] + aabbMax[axis]) * 0.5f;
+      extents[axis][i] = (aabbMax[axis] - aabbMin[axis]) * 0.5f;
+    }
+  }
+
+  void get(int i, btVector3& aabbMin, btVector3& aabbMax) const {
+    for (int axis = 0; axis < 3; ++axis) {
+      aabbMin[axis] = centers[axis][i] - extents[axis][i];
+      aabbMax[axis] = centers[axis][i] + extents[axis][i];
+    }
+  }
+
+  int size() const {
+    return count;
+  }
+
+  QVector<float> centers[3];
+  QVector<float> extents[3];
+
+private:
+  int count;
+};
+
+// Bounding volume hierarchy over a set of boxes, answering frustum, box and sphere queries
+// in about logarithmic time. Built top down, each node is split at the median centre along
+// its widest axis until at most LEAF_SIZE boxes are left.
+//
+// The boxes are stored in tree order, so every node covers a contiguous range of positions
+// and item(position) maps back to what the caller built the tree from. Moving a box refits
+// its ancestors without changing the tree shape, which keeps updates cheap but lets the
+// tree degrade if many boxes travel far; build it again then.
+class Bvh {
+public:
+  enum Containment {
+    Outside = 0,
+    Intersecting,
+    Inside
+  };
+
+  static const int LEAF_SIZE = BoxArray::LANES;
+
+  struct Node {
+    Node() : first(0), count(0), child(-1), parent(-1) {
+      aabbMin.setValue(0, 0, 0); // refit compares against these.
+      aabbMax.setValue(0, 0, 0);
+    }
+
+    btVector3 aabbMin, aabbMax;
+    int first, count; // Range of positions below the node.
+    int child;        // Index of the first of two children, -1 for leaves.
+    int parent;
+  };
+
+  // Volume for range queries.
+  struct Box {
+    Box(const btVector3& aabbMin, const btVector3& aabbMax) : aabbMin(aabbMin), aabbMax(aabbMax) {}
+
+    Containment classifyAabb(const btVector3& boxMin, const btVector3& boxMax) const {
+      Containment result = Inside;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (boxMax[axis] < aabbMin[axis] || boxMin[axis] > aabbMax[axis])
+          return Outside;
+        if (boxMin[axis] < aabbMin[axis] || boxMax[axis] > aabbMax[axis])
+          result = Intersecting;
+      }
+      return result;
+    }
+
+    btVector3 aabbMin, aabbMax;
+  };
+
+  // Volume for radius queries, e.g. everything a light or a reflection probe reaches.
+  struct Sphere {
+    Sphere(const btVector3& center, btScalar radius) : center(center), radius(radius) {}
+
+    Containment classifyAabb(const btVector3& boxMin, const btVector3& boxMax) const {
+      btScalar nearest = 0, farthest = 0;
+      for (int axis = 0; axis < 3; ++axis) {
+        const btScalar below = boxMin[axis] - center[axis];
+        const btScalar above = center[axis] - boxMax[axis];
+        const btScalar outside = btMax(btMax(below, above), btScalar(0));
+        const btScalar farOffset = btMax(btFabs(below), btFabs(above));
+        nearest += outside * outside;
+        farthest += farOffset * farOffset;
+      }
+      if (nearest > radius * radius)
+        return Outside;
+      return farthest <= radius * radius ? Inside : Intersecting;
+    }
+
+    btVector3 center;
+    btScalar radius;
+  };
+
+  // Item i gets the box (aabbMins[i], aabbMaxs[i]).
+  void build(const QVector<btVector3>& aabbMins, const QVector<btVector3>& aabbMaxs) {
+    const int n = aabbMins.size();
+    nodes.clear();
+    items.resize(n);
+    positions.resize(n);
+    leaves.resize(n);
+    boxArray.resize(n);
+    if (n == 0)
+      return;
+
+    QVector<btVector3> centers(n);
+    for (int i = 0; i < n; ++i) {
+      items[i] = i;
+      centers[i] = (aabbMins.at(i) + aabbMaxs.at(i)) * 0.5;
+    }
+
+    // Breadth first, so children always come after their parent.
+    Node root;
+    root.first = 0;
+    root.count = n;
+    root.child = -1;
+    root.parent = -1;
+    nodes.reserve(2 * (n / LEAF_SIZE) + 1);
+    nodes << root;
+    for (int i = 0; i < nodes.size(); ++i) {
+      const int first = nodes.at(i).first;
+      const int count = nodes.at(i).count;
+      if (count <= LEAF_SIZE)
+        continue;
+
+      btVector3 centerMin = centers.at(items.at(first));
+      btVector3 centerMax = centerMin;
+      for (int p = first + 1; p < first + count; ++p) {
+        centerMin.setMin(centers.at(items.at(p)));
+        centerMax.setMax(centers.at(items.at(p)));
+      }
+      const int middle = first + count / 2;
+      int* begin = items.data() + first;
+      std::nth_element(begin, items.data() + middle, begin + count,
+        CenterLess(centers, (centerMax - centerMin).maxAxis()));
+
+      Node left;
+      left.first = first;
+      left.count = middle - first;
+      left.child = -1;
+      left.parent = i;
+      Node right = left;
+      right.first = middle;
+      right.count = first + count - middle;
+      nodes[i].child = nodes.size();
+      nodes << left << right;
+    }
+
+    for (int p = 0; p < n; ++p) {
+      positions[items.at(p)] = p;
+      boxArray.set(p, aabbMins.at(items.at(p)), aabbMaxs.at(items.at(p)));
+    }
+    for (int i = nodes.size() - 1; i >= 0; --i) {
+      refit(i);
+      if (nodes.at(i).child < 0) {
+        for (int p = nodes.at(i).first; p < nodes.at(i).first + nodes.at(i).count; ++p)
+          leaves[p] = i;
+      }
+    }
+  }
+
+  // Moves the box of one item and refits the nodes above it, stopping as soon as a node
+  // keeps its bounds.
+  void update(int item, const btVector3& aabbMin, const btVector3& aabbMax) {
+    const int position = positions.at(item);
+    boxArray.set(position, aabbMin, aabbMax);
+    for (int node = leaves.at(position); node >= 0 && refit(node); node = nodes.at(node).parent) {}
+  }
+
+  // Calls visitor.inside(first, count) for every node the volume contains completely and
+  // visitor.intersecting(first, count) for every leaf it cuts, with ranges of positions in
+  // increasing order. Nothing below a node is looked at once the node is accepted.
+  template <class Volume, class Visitor>
+  void traverse(const Volume& volume, Visitor& visitor, int root = 0) const {
+    if (nodes.isEmpty())
+      return;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = root;
+    while (top > 0) {
+      const Node& node = nodes.at(stack[--top]);
+      const Containment containment = volume.classifyAabb(node.aabbMin, node.aabbMax);
+      if (containment == Outside)
+        continue;
+      if (containment == Inside)
+        visitor.inside(node.first, node.count);
+      else if (node.child < 0)
+        visitor.intersecting(node.first, node.count);
+      else {
+        stack[top++] = node.child + 1;
+        stack[top++] = node.child;
+      }
+    }
+  }
+
+  // Appends the items whose boxes are at least partly inside the volume. The volume needs
+  // a classifyAabb(aabbMin, aabbMax) returning a Containment, Frustum has one.
+  template <class Volume>
+  void query(const Volume& volume, QVector<int>& found) const {
+    Collector<Volume> collector(*this, volume, found);
+    traverse(volume, collector);
+  }
+
+  // The nodes just below the root, expanded level by level until there are at least
+  // minRoots of them (or only leaves are left), left to right. Traversing each of them
+  // covers the whole tree, e.g. on several threads.
+  void splitRoots(int minRoots, QVector<int>& roots) const {
+    roots.clear();
+    if (nodes.isEmpty())
+      return;
+
+    roots << 0;
+    for (bool expanded = true; expanded && roots.size() < minRoots; ) {
+      expanded = false;
+      QVector<int> next;
+      for (int i = 0; i < roots.size(); ++i) {
+        const int child = nodes.at(roots.at(i)).child;
+        if (child >= 0) {
+          next << child << child + 1;
+          expanded = true;
+        }
+        else
+          next << roots.at(i);
+      }
+      roots = next;
+    }
+  }
+
+  int size() const {
+    return items.size();
+  }
+
+  const Node& node(int i) const {
+    return nodes.at(i);
+  }
+
+  // The item stored at a position.
+  int item(int position) const {
+    return items.at(position);
+  }
+
+  // Boxes by position.
+  const BoxArray& boxes() const {
+    return boxArray;
+  }
+
+private:
+  struct CenterLess {
+    CenterLess(const QVector<btVector3>& centers, int axis) : centers(centers), axis(axis) {}
+
+    bool operator()(int a, int b) const {
+      return centers.at(a)[axis] < centers.at(b)[axis];
+    }
+
+    const QVector<btVector3>& centers;
+    int axis;
+  };
+
+  template <class Volume>
+  class Collector {
+  public:
+    Collector(const Bvh& bvh, const Volume& volume, QVector<int>& found) : bvh(bvh), volume(volume), found(found) {}
+
+    void inside(int first, int count) {
+      for (int p = first; p < first + count; ++p)
+        found << bvh.item(p);
+    }
+
+    void intersecting(int first, int count) {
+      btVector3 aabbMin, aabbMax;
+      for (int p = first; p < first + count; ++p) {
+        bvh.boxes().get(p, aabbMin, aabbMax);
+        if (volume.classifyAabb(aabbMin, aabbMax) != Outside)
+          found << bvh.item(p);
+      }
+    }
+
+  private:
+    const Bvh& bvh;
+    const Volume& volume;
+    QVector<int>& found;
+  };
+
+  // Recomputes the bounds of a node from its boxes or children, true if they changed.
+  bool refit(int i) {
+    Node& node = nodes[i];
+    btVector3 aabbMin, aabbMax;
+    if (node.child < 0) {
+      btVector3 boxMin, boxMax;
+      boxArray.get(node.first, aabbMin, aabbMax);
+      for (int p = node.first + 1; p < node.first + node.count; ++p) {
+        boxArray.get(p, boxMin, boxMax);
+        aabbMin.setMin(boxMin);
+        aabbMax.setMax(boxMax);
+      }
+    }
+    else {
+      const Node& left = nodes.at(node.child);
+      const Node& right = nodes.at(node.child + 1);
+      aabbMin = left.aabbMin;
+      aabbMax = left.aabbMax;
+      aabbMin.setMin(right.aabbMin);
+      aabbMax.setMax(right.aabbMax);
+    }
+
+    const bool changed = aabbMin != node.aabbMin || aabbMax != node.aabbMax;
+    node.aabbMin = aabbMin;
+    node.aabbMax = aabbMax;
+    return changed;
+  }
+
+  QVector<Node> nodes;
+  QVector<int> items;     // By position.
+  QVector<int> positions; // By item.
+  QVector<int> leaves;    // Leaf node of each position.
+  BoxArray boxArray;
+};
+
+#endif
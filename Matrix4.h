@@ -0,0 +1,351 @@
+#ifndef MATRIX4_H
+#define MATRIX4_H
+
+#include <cmath>
+#include <cstring>
+
+#include <QVector3D>
+#include <LinearMath/btTransform.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// 4x4 float matrix, column major like OpenGL wants it, so constData() goes to glUniformMatrix4fv
+// or a uniform block as it is. Stands in for QMatrix4x4, which keeps qreal (double on
+// desktop Qt) and needed converting to and from GLfloat and btScalar for every object.
+// The member functions that change the matrix multiply from the right, as in QMatrix4x4.
+// Multiplication, transposition and inversion use SSE when the compiler targets it.
+class Matrix4 {
+public:
+  Matrix4() {
+    setToIdentity();
+  }
+
+  // From a column major array, e.g. what btTransform::getOpenGLMatrix writes.
+  explicit Matrix4(const float* columnMajor) {
+    memcpy(m, columnMajor, sizeof(m));
+  }
+
+  // The rigid transform as a matrix, the same as btTransform::getOpenGLMatrix.
+  explicit Matrix4(const btTransform& transform) {
+    const btMatrix3x3& basis = transform.getBasis();
+    const btVector3& origin = transform.getOrigin();
+    for (int column = 0; column < 3; ++column) {
+      for (int row = 0; row < 3; ++row)
+        m[column * 4 + row] = basis[row][column];
+      m[column * 4 + 3] = 0;
+    }
+    m[12] = origin.x();
+    m[13] = origin.y();
+    m[14] = origin.z();
+    m[15] = 1;
+  }
+
+  void setToIdentity() {
+    memset(m, 0, sizeof(m));
+    m[0] = m[5] = m[10] = m[15] = 1;
+  }
+
+  float* data() {
+    return m;
+  }
+
+  const float* constData() const {
+    return m;
+  }
+
+  // Element at row, column.
+  float operator()(int row, int column) const {
+    return m[column * 4 + row];
+  }
+
+  Matrix4 operator*(const Matrix4& other) const {
+    Matrix4 result(Uninitialized);
+    multiply(m, other.m, result.m);
+    return result;
+  }
+
+  Matrix4& operator*=(const Matrix4& other) {
+    multiply(m, other.m, m);
+    return *this;
+  }
+
+  Matrix4 transposed() const {
+    Matrix4 result(Uninitialized);
+#if defined(__SSE__)
+    __m128 c0 = _mm_load_ps(m);
+    __m128 c1 = _mm_load_ps(m + 4);
+    __m128 c2 = _mm_load_ps(m + 8);
+    __m128 c3 = _mm_load_ps(m + 12);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    _mm_store_ps(result.m, c0);
+    _mm_store_ps(result.m + 4, c1);
+    _mm_store_ps(result.m + 8, c2);
+    _mm_store_ps(result.m + 12, c3);
+#else
+    for (int column = 0; column < 4; ++column) {
+      for (int row = 0; row < 4; ++row)
+        result.m[row * 4 + column] = m[column * 4 + row];
+    }
+#endif
+    return result;
+  }
+
+  // The identity if the matrix can't be inverted, like QMatrix4x4::inverted.
+  Matrix4 inverted() const {
+    Matrix4 result(Uninitialized);
+    if (!invert(m, result.m))
+      result.setToIdentity();
+    return result;
+  }
+
+  void translate(float x, float y, float z) {
+    for (int row = 0; row < 4; ++row)
+      m[12 + row] += m[row] * x + m[4 + row] * y + m[8 + row] * z;
+  }
+
+  void scale(float x, float y, float z) {
+    for (int row = 0; row < 4; ++row) {
+      m[row] *= x;
+      m[4 + row] *= y;
+      m[8 + row] *= z;
+    }
+  }
+
+  void scale(float factor) {
+    scale(factor, factor, factor);
+  }
+
+  // Rotation by angle degrees around axis.
+  void rotate(float angle, const QVector3D& axis) {
+    const QVector3D a = axis.normalized();
+    const float x = a.x(), y = a.y(), z = a.z();
+    const float radians = angle * float(M_PI / 180);
+    const float c = cos(radians), s = sin(radians), ic = 1 - c;
+    Matrix4 rotation;
+    rotation.m[0] = x * x * ic + c;
+    rotation.m[1] = y * x * ic + z * s;
+    rotation.m[2] = x * z * ic - y * s;
+    rotation.m[4] = x * y * ic - z * s;
+    rotation.m[5] = y * y * ic + c;
+    rotation.m[6] = y * z * ic + x * s;
+    rotation.m[8] = x * z * ic + y * s;
+    rotation.m[9] = y * z * ic - x * s;
+    rotation.m[10] = z * z * ic + c;
+    *this *= rotation;
+  }
+
+  // Vertical field of view in degrees.
+  void perspective(float angle, float aspect, float nearPlane, float farPlane) {
+    const float radians = angle * 0.5f * float(M_PI / 180);
+    const float sine = sin(radians);
+    if (sine == 0 || nearPlane == farPlane || aspect == 0)
+      return;
+    const float cotan = cos(radians) / sine;
+    const float clip = farPlane - nearPlane;
+    Matrix4 projection;
+    projection.m[0] = cotan / aspect;
+    projection.m[5] = cotan;
+    projection.m[10] = -(nearPlane + farPlane) / clip;
+    projection.m[11] = -1;
+    projection.m[14] = -(2 * nearPlane * farPlane) / clip;
+    projection.m[15] = 0;
+    *this *= projection;
+  }
+
+  void ortho(float left, float right, float bottom, float top, float nearPlane, float farPlane) {
+    if (left == right || bottom == top || nearPlane == farPlane)
+      return;
+    const float width = right - left;
+    const float height = top - bottom;
+    const float clip = farPlane - nearPlane;
+    Matrix4 projection;
+    projection.m[0] = 2 / width;
+    projection.m[5] = 2 / height;
+    projection.m[10] = -2 / clip;
+    projection.m[12] = -(left + right) / width;
+    projection.m[13] = -(top + bottom) / height;
+    projection.m[14] = -(nearPlane + farPlane) / clip;
+    *this *= projection;
+  }
+
+  void lookAt(const QVector3D& eye, const QVector3D& center, const QVector3D& up) {
+    const QVector3D forward = (center - eye).normalized();
+    const QVector3D side = QVector3D::crossProduct(forward, up).normalized();
+    const QVector3D upVector = QVector3D::crossProduct(side, forward);
+    Matrix4 view;
+    view.m[0] = side.x();
+    view.m[4] = side.y();
+    view.m[8] = side.z();
+    view.m[1] = upVector.x();
+    view.m[5] = upVector.y();
+    view.m[9] = upVector.z();
+    view.m[2] = -forward.x();
+    view.m[6] = -forward.y();
+    view.m[10] = -forward.z();
+    *this *= view;
+    translate(-eye.x(), -eye.y(), -eye.z());
+  }
+
+private:
+  enum UninitializedTag { Uninitialized };
+  Matrix4(UninitializedTag) {}
+
+  // result = a * b, result may be a or b.
+  static void multiply(const float* a, const float* b, float* result) {
+#if defined(__SSE__)
+    const __m128 a0 = _mm_load_ps(a);
+    const __m128 a1 = _mm_load_ps(a + 4);
+    const __m128 a2 = _mm_load_ps(a + 8);
+    const __m128 a3 = _mm_load_ps(a + 12);
+    __m128 columns[4];
+    for (int j = 0; j < 4; ++j) {
+      const float* bj = b + j * 4;
+      columns[j] = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(bj[0])), _mm_mul_ps(a1, _mm_set1_ps(bj[1]))),
+        _mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(bj[2])), _mm_mul_ps(a3, _mm_set1_ps(bj[3]))));
+    }
+    for (int j = 0; j < 4; ++j)
+      _mm_store_ps(result + j * 4, columns[j]);
+#else
+    float product[16];
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 4; ++i)
+        product[j * 4 + i] = a[i] * b[j * 4] + a[4 + i] * b[j * 4 + 1] + a[8 + i] * b[j * 4 + 2] + a[12 + i] * b[j * 4 + 3];
+    }
+    memcpy(result, product, sizeof(product));
+#endif
+  }
+
+  // Inverse by cofactors, false if the determinant is 0. The SSE version follows Intel's
+  // "Streaming SIMD Extensions - Inverse of 4x4 Matrix" (AP-928); it works on either
+  // storage order because the inverse of the transpose is the transpose of the inverse.
+  static bool invert(const float* src, float* result) {
+#if defined(__SSE__)
+    __m128 minor0, minor1, minor2, minor3;
+    __m128 row0, row1, row2, row3;
+    __m128 det, tmp1;
+
+    tmp1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src)), (const __m64*)(src + 4));
+    row1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 8)), (const __m64*)(src + 12));
+    row0 = _mm_shuffle_ps(tmp1, row1, 0x88);
+    row1 = _mm_shuffle_ps(row1, tmp1, 0xDD);
+    tmp1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 2)), (const __m64*)(src + 6));
+    row3 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 10)), (const __m64*)(src + 14));
+    row2 = _mm_shuffle_ps(tmp1, row3, 0x88);
+    row3 = _mm_shuffle_ps(row3, tmp1, 0xDD);
+
+    tmp1 = _mm_mul_ps(row2, row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor0 = _mm_mul_ps(row1, tmp1);
+    minor1 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(_mm_mul_ps(row1, tmp1), minor0);
+    minor1 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor1);
+    minor1 = _mm_shuffle_ps(minor1, minor1, 0x4E);
+
+    tmp1 = _mm_mul_ps(row1, row2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor0 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor0);
+    minor3 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row3, tmp1));
+    minor3 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor3);
+    minor3 = _mm_shuffle_ps(minor3, minor3, 0x4E);
+
+    tmp1 = _mm_mul_ps(_mm_shuffle_ps(row1, row1, 0x4E), row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    row2 = _mm_shuffle_ps(row2, row2, 0x4E);
+    minor0 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor0);
+    minor2 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row2, tmp1));
+    minor2 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor2);
+    minor2 = _mm_shuffle_ps(minor2, minor2, 0x4E);
+
+    tmp1 = _mm_mul_ps(row0, row1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor2 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor2);
+    minor3 = _mm_sub_ps(_mm_mul_ps(row2, tmp1), minor3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor2 = _mm_sub_ps(_mm_mul_ps(row3, tmp1), minor2);
+    minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row2, tmp1));
+
+    tmp1 = _mm_mul_ps(row0, row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row2, tmp1));
+    minor2 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor1 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor1);
+    minor2 = _mm_sub_ps(minor2, _mm_mul_ps(row1, tmp1));
+
+    tmp1 = _mm_mul_ps(row0, row2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor1 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor1);
+    minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row1, tmp1));
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row3, tmp1));
+    minor3 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor3);
+
+    det = _mm_mul_ps(row0, minor0);
+    det = _mm_add_ps(_mm_shuffle_ps(det, det, 0x4E), det);
+    det = _mm_add_ss(_mm_shuffle_ps(det, det, 0xB1), det);
+    if (_mm_cvtss_f32(det) == 0)
+      return false;
+    det = _mm_div_ss(_mm_set_ss(1), det);
+    det = _mm_shuffle_ps(det, det, 0x00);
+
+    _mm_store_ps(result, _mm_mul_ps(det, minor0));
+    _mm_store_ps(result + 4, _mm_mul_ps(det, minor1));
+    _mm_store_ps(result + 8, _mm_mul_ps(det, minor2));
+    _mm_store_ps(result + 12, _mm_mul_ps(det, minor3));
+    return true;
+#else
+    float inverse[16];
+    inverse[0] = src[5] * src[10] * src[15] - src[5] * src[11] * src[14] - src[9] * src[6] * src[15] +
+      src[9] * src[7] * src[14] + src[13] * src[6] * src[11] - src[13] * src[7] * src[10];
+    inverse[4] = -src[4] * src[10] * src[15] + src[4] * src[11] * src[14] + src[8] * src[6] * src[15] -
+      src[8] * src[7] * src[14] - src[12] * src[6] * src[11] + src[12] * src[7] * src[10];
+    inverse[8] = src[4] * src[9] * src[15] - src[4] * src[11] * src[13] - src[8] * src[5] * src[15] +
+      src[8] * src[7] * src[13] + src[12] * src[5] * src[11] - src[12] * src[7] * src[9];
+    inverse[12] = -src[4] * src[9] * src[14] + src[4] * src[10] * src[13] + src[8] * src[5] * src[14] -
+      src[8] * src[6] * src[13] - src[12] * src[5] * src[10] + src[12] * src[6] * src[9];
+    inverse[1] = -src[1] * src[10] * src[15] + src[1] * src[11] * src[14] + src[9] * src[2] * src[15] -
+      src[9] * src[3] * src[14] - src[13] * src[2] * src[11] + src[13] * src[3] * src[10];
+    inverse[5] = src[0] * src[10] * src[15] - src[0] * src[11] * src[14] - src[8] * src[2] * src[15] +
+      src[8] * src[3] * src[14] + src[12] * src[2] * src[11] - src[12] * src[3] * src[10];
+    inverse[9] = -src[0] * src[9] * src[15] + src[0] * src[11] * src[13] + src[8] * src[1] * src[15] -
+      src[8] * src[3] * src[13] - src[12] * src[1] * src[11] + src[12] * src[3] * src[9];
+    inverse[13] = src[0] * src[9] * src[14] - src[0] * src[10] * src[13] - src[8] * src[1] * src[14] +
+      src[8] * src[2] * src[13] + src[12] * src[1] * src[10] - src[12] * src[2] * src[9];
+    inverse[2] = src[1] * src[6] * src[15] - src[1] * src[7] * src[14] - src[5] * src[2] * src[15] +
+      src[5] * src[3] * src[14] + src[13] * src[2] * src[7] - src[13] * src[3] * src[6];
+    inverse[6] = -src[0] * src[6] * src[15] + src[0] * src[7] * src[14] + src[4] * src[2] * src[15] -
+      src[4] * src[3] * src[14] - src[12] * src[2] * src[7] + src[12] * src[3] * src[6];
+    inverse[10] = src[0] * src[5] * src[15] - src[0] * src[7] * src[13] - src[4] * src[1] * src[15] +
+      src[4] * src[3] * src[13] + src[12] * src[1] * src[7] - src[12] * src[3] * src[5];
+    inverse[14] = -src[0] * src[5] * src[14] + src[0] * src[6] * src[13] + src[4] * src[1] * src[14] -
+      src[4] * src[2] * src[13] - src[12] * src[1] * src[6] + src[12] * src[2] * src[5];
+    inverse[3] = -src[1] * src[6] * src[11] + src[1] * src[7] * src[10] + src[5] * src[2] * src[11] -
+      src[5] * src[3] * src[10] - src[9] * src[2] * src[7] + src[9] * src[3] * src[6];
+    inverse[7] = src[0] * src[6] * src[11] - src[0] * src[7] * src[10] - src[4] * src[2] * src[11] +
+      src[4] * src[3] * src[10] + src[8] * src[2] * src[7] - src[8] * src[3] * src[6];
+    inverse[11] = -src[0] * src[5] * src[11] + src[0] * src[7] * src[9] + src[4] * src[1] * src[11] -
+      src[4] * src[3] * src[9] - src[8] * src[1] * src[7] + src[8] * src[3] * src[5];
+    inverse[15] = src[0] * src[5] * src[10] - src[0] * src[6] * src[9] - src[4] * src[1] * src[10] +
+      src[4] * src[2] * src[9] + src[8] * src[1] * src[6] - src[8] * src[2] * src[5];
+
+    const float det = src[0] * inverse[0] + src[1] * inverse[4] + src[2] * inverse[8] + src[3] * inverse[12];
+    if (det == 0)
+      return false;
+    for (int i = 0; i < 16; ++i)
+      result[i] = inverse[i] / det;
+    return true;
+#endif
+  }
+
+  float m[16] __attribute__((aligned(16)));
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef PACK_H
+#define PACK_H
+
+// Read-only archive with all the assets of a level, written by packtool.py.
+// Format (little endian):
+// magic "MTPK"       |
+// version            |
+// nEntries           |  4 bytes each
+// namesSize          |
+// nEntries * {hash, type, nameOffset, nameLength (4 bytes each), offset, size (8 bytes each)}, sorted by hash
+// names (namesSize bytes of UTF-8, not terminated)
+// entry data, each entry aligned to 16 bytes
+//
+// Names are paths relative to the directory of the pack with '/' separators, exactly as
+// the .scene file references them. The hash is the 32-bit FNV-1a of the UTF-8 name.
+// Texture entries hold width and height (4 bytes each) followed by RGBA8 rows from bottom
+// to top, ready for glTexImage2D. Image entries hold an encoded jpg/png, Dds entries a
+// block compressed texture with its mip chain as written by textool.py.
+class Pack {
+public:
+  enum EntryType {
+    Raw = 0,
+    Image,
+    Texture,
+    Dds
+  };
+
+  struct Entry {
+    quint32 hash;
+    quint32 type;
+    quint32 nameOffset;
+    quint32 nameLength;
+    quint64 offset;
+    quint64 size;
+  };
+
+  static const int HEADER_SIZE = 4 * 4;
+  static const quint32 VERSION = 1;
+
+  Pack() {
+    mapped = NULL;
+    entries = NULL;
+    names = NULL;
+    nEntries = 0;
+  }
+
+  ~Pack() {
+    close();
+  }
+
+  // Maps the whole pack. Entries are stored in the order a level loads them, so touching
+  // the pages here turns the cold-start I/O into one sequential read.
+  bool open(const QString& fileName) {
+    close();
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+      error = "Error opening pack " + fileName + "!";
+      return false;
+    }
+
+    const qint64 fileSize = file.size();
+    if (fileSize >= HEADER_SIZE)
+      mapped = file.map(0, fileSize);
+    if (mapped == NULL) {
+      error = "Error mapping pack " + fileName + "!";
+      close();
+      return false;
+    }
+
+    const quint32* header = reinterpret_cast<const quint32*>(mapped); // TODO: endianness?
+    if (memcmp(mapped, "MTPK", 4) != 0 || header[1] != VERSION) {
+      error = "Unknown pack format in " + fileName + "!";
+      close();
+      return false;
+    }
+
+    nEntries = header[2];
+    const quint32 namesSize = header[3];
+    if (HEADER_SIZE + quint64(nEntries) * sizeof(Entry) + namesSize > quint64(fileSize)) {
+      error = "Header of " + fileName + " does not match the file size!";
+      close();
+      return false;
+    }
+
+    entries = reinterpret_cast<const Entry*>(mapped + HEADER_SIZE);
+    names = reinterpret_cast<const char*>(entries + nEntries);
+    for (quint32 i = 0; i < nEntries; ++i) {
+      const Entry& entry = entries[i];
+      if (quint64(entry.nameOffset) + entry.nameLength > namesSize ||
+          entry.offset > quint64(fileSize) || entry.size > quint64(fileSize) - entry.offset) {
+        error = "Corrupt entry table in " + fileName + "!";
+        close();
+        return false;
+      }
+    }
+
+    volatile uchar touched = 0;
+    for (qint64 i = 0; i < fileSize; i += 4096)
+      touched += mapped[i];
+
+    // Same form as QFileInfo::absoluteFilePath, so packed and loose assets share cache keys.
+    root = QFileInfo(fileName).absolutePath() + "/";
+    return true;
+  }
+
+  void close() {
+    if (mapped != NULL)
+      file.unmap(mapped);
+    file.close();
+    mapped = NULL;
+    entries = NULL;
+    names = NULL;
+    nEntries = 0;
+  }
+
+  bool isOpen() const {
+    return mapped != NULL;
+  }
+
+  const Entry* find(const QString& name) const {
+    const QByteArray utf8 = name.toUtf8();
+    const quint32 h = hash(utf8);
+
+    quint32 low = 0, high = nEntries;
+    while (low < high) {
+      quint32 middle = (low + high) / 2;
+      if (entries[middle].hash < h)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+
+    for (; low < nEntries && entries[low].hash == h; ++low) {
+      const Entry& entry = entries[low];
+      if (entry.nameLength == quint32(utf8.size()) && memcmp(names + entry.nameOffset, utf8.constData(), utf8.size()) == 0)
+        return &entry;
+    }
+    return NULL;
+  }
+
+  // Points into the mapping, valid as long as the pack stays open.
+  const uchar* data(const Entry* entry) const {
+    return mapped + entry->offset;
+  }
+
+  // Wraps the entry without copying, valid as long as the pack stays open.
+  QByteArray bytes(const Entry* entry) const {
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(data(entry)), entry->size);
+  }
+
+  // Absolute directory of the pack, with a trailing '/'.
+  const QString& path() const {
+    return root;
+  }
+
+  const QString& errorString() const {
+    return error;
+  }
+
+  static quint32 hash(const QByteArray& name) {
+    quint32 h = 2166136261u;
+    for (int i = 0; i < name.size(); ++i) {
+      h ^= uchar(name[i]);
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+private:
+  QFile file;
+  uchar* mapped;
+  const Entry* entries;
+  const char* names;
+  quint32 nEntries;
+  QString root;
+  QString error;
+};
+
+#endif
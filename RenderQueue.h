@@ -0,0 +1,103 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+// The draws of one frame, ordered by 64-bit keys. Key layout, from the most significant bit:
+//   opaque:      pass (2) | 0 | shader (10) | texture set (12) | mesh (12) | depth (24) | unused (3)
+//   translucent: pass (2) | 1 | far to near (24) | shader (10) | texture set (12) | mesh (12) | unused (3)
+// Opaque draws are grouped by state and go front to back within a group, which helps early
+// depth rejection. Translucent draws come after them and go back to front.
+class RenderQueue {
+public:
+  struct Item {
+    quint64 key;
+    int index; // What to draw, e.g. an index into the owner's objects.
+  };
+
+  static const int SHADER_BITS = 10;
+  static const int TEXTURE_SET_BITS = 12;
+  static const int MESH_BITS = 12;
+  static const int DEPTH_BITS = 24;
+
+  // Ids are small numbers handed out by the owner, larger ones wrap around (which only
+  // costs state changes). depth is the view distance divided by the far plane, in [0, 1].
+  static quint64 makeKey(unsigned int pass, bool translucent, quint32 shader, quint32 textureSet, quint32 mesh, float depth) {
+    const quint64 maxDepth = (quint64(1) << DEPTH_BITS) - 1;
+    const quint64 quantised = quint64(clampedDepth(depth) * maxDepth);
+    const quint64 state = (quint64(shader & ((1u << SHADER_BITS) - 1)) << (TEXTURE_SET_BITS + MESH_BITS)) |
+      (quint64(textureSet & ((1u << TEXTURE_SET_BITS) - 1)) << MESH_BITS) |
+      quint64(mesh & ((1u << MESH_BITS) - 1));
+
+    quint64 key = quint64(pass & 3) << 62;
+    if (translucent)
+      key |= (quint64(1) << 61) | ((maxDepth - quantised) << 37) | (state << 3);
+    else
+      key |= (state << 27) | (quantised << 3);
+    return key;
+  }
+
+  void clear() {
+    items.clear();
+  }
+
+  void add(quint64 key, int index) {
+    Item item;
+    item.key = key;
+    item.index = index;
+    items << item;
+  }
+
+  void append(const QVector<Item>& more) {
+    items += more;
+  }
+
+  int size() const {
+    return items.size();
+  }
+
+  const Item& at(int i) const {
+    return items.at(i);
+  }
+
+  // Stable LSD radix sort, one byte per pass. Passes over bytes that are the same in
+  // every key (the pass bits, usually most of the ids) are skipped.
+  void sort() {
+    const int n = items.size();
+    if (n < 2)
+      return;
+
+    scratch.resize(n);
+    Item* source = items.data();
+    Item* destination = scratch.data();
+    for (int shift = 0; shift < 64; shift += 8) {
+      int counts[256];
+      memset(counts, 0, sizeof(counts));
+      for (int i = 0; i < n; ++i)
+        ++counts[(source[i].key >> shift) & 0xff];
+      if (counts[(source[0].key >> shift) & 0xff] == n)
+        continue;
+
+      int offset = 0;
+      for (int digit = 0; digit < 256; ++digit) {
+        const int count = counts[digit];
+        counts[digit] = offset;
+        offset += count;
+      }
+      for (int i = 0; i < n; ++i)
+        destination[counts[(source[i].key >> shift) & 0xff]++] = source[i];
+      std::swap(source, destination);
+    }
+
+    if (source != items.data())
+      memcpy(items.data(), source, n * sizeof(Item));
+  }
+
+private:
+  static float clampedDepth(float depth) {
+    return depth < 0 ? 0 : (depth > 1 ? 1 : depth);
+  }
+
+  QVector<Item> items;
+  QVector<Item> scratch;
+};
+
+#endif
@@ -7,7 +7,11 @@ SOURCES = App.cpp \
     BulletFileLoader/btBulletFile.cpp \
     vehicle/btRaycastVehicle.cpp \
     vehicle/btWheelInfo.cpp
-HEADERS = App.h
+HEADERS = App.h \
+    Pack.h \
+    RenderQueue.h \
+    Bvh.h \
+    Matrix4.h
 INCLUDEPATH += /home/matej/college/grafika/bullet/src
 INCLUDEPATH += /home/matej/college/grafika/bullet/Extras/Serialize/BulletWorldImporter
 QMAKE_LIBDIR += /home/matej/college/grafika/app
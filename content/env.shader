@@ -15,12 +15,13 @@
   uniform mat4 model;
   uniform mat4 proj;
   uniform vec3 cam_pos;
+  uniform vec2 height_decode;
 
   void main() {
     gl_Position = proj * modelView * vec4(position, 1);
     pnormal = normalize((modelView * model * vec4(normal, 0)).xyz);
     pcoords = coords;
-    height = position.z;
+    height = height_decode.x + height_decode.y * position.z;
     vec4 world_pos = model * vec4(position, 1);
     vec3 E = normalize(world_pos.xyz - cam_pos);
     reflected = reflect(E, pnormal);
@@ -1,16 +1,29 @@
 <program>
   <attribute name="position" unit="0"></attribute>
   <attribute name="normal" unit="1"></attribute>
+  <attribute name="instanceModel" unit="8"></attribute>
 
   <shader type="vertex">
   <![CDATA[
+  #extension GL_ARB_uniform_buffer_object : enable
   in vec3 position;
   in vec3 normal;
+  in mat4 instanceModel;
   out vec3 pnormal;
-  uniform mat4 modelView;
-  uniform mat4 proj;
+  out vec3 plight_dir;
+  layout(std140) uniform Frame {
+    mat4 proj;
+    mat4 view;
+    mat4 shadowProj;
+    mat4 shadowModelView;
+    mat4 bias;
+    vec3 light_dir;
+    vec3 camPosition;
+  };
   
   void main() {
+    mat4 modelView = view * instanceModel;
+    plight_dir = (modelView * vec4(light_dir, 0)).xyz;
     gl_Position = proj * modelView * vec4(position, 1);
     pnormal = (modelView * vec4(normal, 0)).xyz;
   }
@@ -20,14 +33,13 @@
   <shader type="pixel">
   <![CDATA[
   in vec3 pnormal;
-  uniform mat4 modelView;
-  uniform vec3 light_dir;
+  in vec3 plight_dir;
  
   const vec3 light_diffuse = vec3(0.8, 0.8, 0.8);
   const vec4 color = vec4(0.8, 0.7, 0.0, 1);
 
   void main() {
-    vec4 L = vec4(normalize((modelView * vec4(light_dir, 0)).xyz), 0);
+    vec4 L = vec4(normalize(plight_dir), 0);
     vec4 N = vec4(normalize(pnormal), 0);
     vec4 diffuse = vec4(max(dot(N, L), 0.0) * light_diffuse, 0);
     gl_FragColor = color * diffuse + color * 0.7;
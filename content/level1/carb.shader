@@ -2,23 +2,37 @@
   <attribute name="position" unit="0"></attribute>
   <attribute name="normal" unit="1"></attribute>
   <attribute name="color" unit="2"></attribute>
+  <attribute name="instanceModel" unit="8"></attribute>
+  <attribute name="instanceLayer" unit="12"></attribute>
 
   <shader type="vertex">
   <![CDATA[
+  #extension GL_ARB_uniform_buffer_object : enable
   in vec3 position;
   in vec3 normal;
   in vec2 color;
+  in mat4 instanceModel;
+  in float instanceLayer;
+  out float player;
   out vec3 pnormal;
   out vec2 pcolor;
   out vec4 shadowCoord;
-  uniform mat4 modelView;
-  uniform mat4 model;
-  uniform mat4 proj;
-  uniform mat4 bias;
-  uniform mat4 shadowProj;
-  uniform mat4 shadowModelView;
+  out vec3 plight_dir;
+  layout(std140) uniform Frame {
+    mat4 proj;
+    mat4 view;
+    mat4 shadowProj;
+    mat4 shadowModelView;
+    mat4 bias;
+    vec3 light_dir;
+    vec3 camPosition;
+  };
  
   void main() {
+    mat4 model = instanceModel;
+    mat4 modelView = view * model;
+    player = instanceLayer;
+    plight_dir = (modelView * vec4(light_dir, 0)).xyz;
     gl_Position = proj * modelView * vec4(position, 1);
     shadowCoord = bias * shadowProj * shadowModelView * model * vec4(position, 1);
     pnormal = (modelView * model * vec4(normal, 0)).xyz;
@@ -29,21 +43,22 @@
 
   <shader type="pixel">
   <![CDATA[
+  #extension GL_EXT_texture_array : enable
   in vec3 pnormal;
   in vec2 pcolor;
   in vec4 shadowCoord;
-  uniform sampler2D texture0;
+  in vec3 plight_dir;
+  in float player;
+  uniform sampler2DArray texture0;
   uniform sampler2D depth;
-  uniform mat4 modelView;
-  uniform vec3 light_dir;
 
   const vec3 light_diffuse = vec3(0.8, 0.8, 0.8);
 
   void main() {
-    vec4 L = vec4(normalize((modelView * vec4(light_dir, 0)).xyz), 0);
+    vec4 L = vec4(normalize(plight_dir), 0);
     vec4 N = vec4(normalize(pnormal), 0);
     vec4 diffuse = vec4(max(dot(N, L), 0.0) * light_diffuse, 0);
-    vec4 ao = texture2D(texture0, pcolor);
+    vec4 ao = texture2DArray(texture0, vec3(pcolor, player));
     vec4 ambient = vec4(0.2, 1, 0.2, 1);
 
 		vec4 shadowCoordinateWdivide = shadowCoord / shadowCoord.w;
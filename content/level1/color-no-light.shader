@@ -2,17 +2,32 @@
   <attribute name="position" unit="0"></attribute>
   <attribute name="normal" unit="1"></attribute>
   <attribute name="color" unit="2"></attribute>
+  <attribute name="instanceModel" unit="8"></attribute>
+  <attribute name="instanceLayer" unit="12"></attribute>
 
   <shader type="vertex">
   <![CDATA[
+  #extension GL_ARB_uniform_buffer_object : enable
   in vec3 position;
   in vec3 normal;
   in vec2 color;
+  in mat4 instanceModel;
+  in float instanceLayer;
+  out float player;
   out vec2 pcolor;
-  uniform mat4 modelView;
-  uniform mat4 proj;
+  layout(std140) uniform Frame {
+    mat4 proj;
+    mat4 view;
+    mat4 shadowProj;
+    mat4 shadowModelView;
+    mat4 bias;
+    vec3 light_dir;
+    vec3 camPosition;
+  };
   
   void main() {
+    mat4 modelView = view * instanceModel;
+    player = instanceLayer;
     gl_Position = proj * modelView * vec4(position, 1);
     pcolor = color;
   }
@@ -21,11 +36,13 @@
 
   <shader type="pixel">
   <![CDATA[
+  #extension GL_EXT_texture_array : enable
   in vec2 pcolor;
-  uniform sampler2D texture0;
+  in float player;
+  uniform sampler2DArray texture0;
  
   void main() {
-    gl_FragColor = texture2D(texture0, pcolor);
+    gl_FragColor = texture2DArray(texture0, vec3(pcolor, player));
     gl_FragColor.a = 1;
   }
   ]]>
@@ -2,22 +2,34 @@
   <attribute name="position" unit="0"></attribute>
   <attribute name="normal" unit="1"></attribute>
   <attribute name="color" unit="2"></attribute>
+  <attribute name="instanceModel" unit="8"></attribute>
+  <attribute name="instanceLayer" unit="12"></attribute>
 
   <shader type="vertex">
+  #extension GL_ARB_uniform_buffer_object : enable
   in vec3 position;
   in vec3 normal;
   in vec2 color;
+  in mat4 instanceModel;
+  in float instanceLayer;
+  out float player;
   out vec3 pnormal;
   out vec2 pcolor;
   out vec4 shadowCoord;
-  uniform mat4 modelView;
-  uniform mat4 model;
-  uniform mat4 proj;
-  uniform mat4 bias;
-  uniform mat4 shadowProj;
-  uniform mat4 shadowModelView;
+  layout(std140) uniform Frame {
+    mat4 proj;
+    mat4 view;
+    mat4 shadowProj;
+    mat4 shadowModelView;
+    mat4 bias;
+    vec3 light_dir;
+    vec3 camPosition;
+  };
  
   void main() {
+    mat4 model = instanceModel;
+    mat4 modelView = view * model;
+    player = instanceLayer;
     gl_Position = proj * modelView * vec4(position, 1);
     shadowCoord = bias * shadowProj * shadowModelView * model * vec4(position, 1);
     pnormal = (modelView * model * vec4(normal, 0)).xyz;
@@ -27,10 +39,12 @@
 
   <shader type="pixel">
   <![CDATA[
+  #extension GL_EXT_texture_array : enable
   in vec3 pnormal;
   in vec2 pcolor;
   in vec4 shadowCoord;
-  uniform sampler2D texture0;
+  in float player;
+  uniform sampler2DArray texture0;
   uniform sampler2D depth;
 
   void main() {
@@ -41,7 +55,7 @@
 	 	if (shadowCoord.w > 0.0)
 	 	  shadow = distanceFromLight < shadowCoordinateWdivide.z ? 0.5 : 1.0;
 
-    vec4 base = texture2D(texture0, pcolor);
+    vec4 base = texture2DArray(texture0, vec3(pcolor, player));
     gl_FragColor = base * shadow;
     gl_FragColor.a = 1;
   }
@@ -1,7 +1,7 @@
 bl_addon_info = {
 "name": "MESH Export",
 "author": "Matej Drame",
-"version": (0, 3),
+"version": (0, 4),
 "blender": (2, 5, 7),
 "api": 35266,
 "location": "File > Export",
@@ -20,12 +20,12 @@ import os
 def export_mesh(obj, scene_path, mesh_name):
   """
   // Format:
-  // format version (1 byte)
+  // format version (4 bytes)
   // nVertices (4 bytes)
   // nIndices (4 bytes)
-  // vertexSize (1 byte)
-  // indexSize (1 byte)
-  // vertexBuffer (nVertices * vertexSize)
+  // vertexSize (4 bytes)
+  // indexSize (4 bytes, 2 if nVertices <= 65536, otherwise 4)
+  // vertexBuffer (nVertices * vertexSize), welded (unique) vertices
   // indexBuffer (nIndices * indexSize)
   """
   #bpy.ops.object.mode_set(mode='EDIT')
@@ -68,23 +68,35 @@ def export_mesh(obj, scene_path, mesh_name):
       vertex.append(coords.uv3)
     vertices.append(vertex)
 
+  # Weld corners that share position, normal and uvs.
+  unique = {}
+  packed = []
+  indices = []
+  for v in vertices:
+    data = pack('<fff', *v[0]) + pack('<fff', *v[1])
+    for uv in v[2:]:
+      data += pack('<ff', *uv)
+    if data not in unique:
+      unique[data] = len(packed)
+      packed.append(data)
+    indices.append(unique[data])
+
   filepath = os.path.join(os.path.dirname(scene_path), mesh_name)
   with open(filepath, 'wb') as f:
-    f.write(pack('<I', 2))
-    f.write(pack('<I', len(vertices)))
-    f.write(pack('<I', len(vertices)))
+    index_size = 2 if len(packed) <= 0x10000 else 4
+    f.write(pack('<I', 3))
+    f.write(pack('<I', len(packed)))
+    f.write(pack('<I', len(indices)))
     vertex_size = sum(len(component)*4 for component in vertices[0])
     f.write(pack('<I', vertex_size))
-    f.write(pack('<I', 4))
+    f.write(pack('<I', index_size))
 
-    for v in vertices:
-      f.write(pack('<fff', *v[0]))
-      f.write(pack('<fff', *v[1]))
-      for uv in v[2:]:
-        f.write(pack('<ff', *uv))
+    for data in packed:
+      f.write(data)
 
-    for index in range(len(vertices)):
-      f.write(pack('<I', index))
+    index_format = '<H' if index_size == 2 else '<I'
+    for index in indices:
+      f.write(pack(index_format, index))
 
 class MeshExporter(bpy.types.Operator):
   '''Exports to MESH'''
@@ -110,12 +122,12 @@ class MeshExporter(bpy.types.Operator):
     """Exports all selected objects into mesh format.
 
     // Format:
-    // format version (1 byte)
+    // format version (4 bytes)
     // nVertices (4 bytes)
     // nIndices (4 bytes)
-    // vertexSize (1 byte)
-    // indexSize (1 byte)
-    // vertexBuffer (nVertices * vertexSize)
+    // vertexSize (4 bytes)
+    // indexSize (4 bytes, 2 if nVertices <= 65536, otherwise 4)
+    // vertexBuffer (nVertices * vertexSize), welded (unique) vertices
     // indexBuffer (nIndices * indexSize)
     """
     obj = bpy.context.selected_objects[0]
@@ -0,0 +1,397 @@
+#!/usr/bin/env python3
+"""Offline tool for .mesh files.
+
+A mesh starts with a header of five little endian 4-byte fields: the format
+version, nVertices, nIndices, vertexSize and indexSize. The vertex buffer
+(nVertices * vertexSize bytes) and the index buffer (nIndices * indexSize bytes)
+follow.
+
+Version 1 and 2 files were written by the Blender exporters, version 2 with one
+vertex per triangle corner and an identity index buffer. Version 3 stores welded
+(unique) vertices and uses 16-bit indices whenever nVertices allows it.
+
+Version 4 adds an explicit vertex format right after the header:
+  nAttributes (4 bytes)
+  positionOffset (3 floats), positionScale (1 float)
+  nAttributes * {semantic, components, type, normalized (1 byte each), offset (4 bytes)}
+Without it (versions 1-3) the layout is position, normal and up to three uvs, all
+32-bit floats. The quantize step writes 16-bit normalised positions relative to
+the mesh bounds, 10_10_10_2 normals and half-float uvs where the range allows.
+
+The optimize step reorders triangles for the post-transform vertex cache
+(Forsyth), then reorders clusters of triangles to reduce overdraw (Sander et al.,
+"Fast triangle reordering for vertex locality and reduced overdraw") and finally
+renumbers vertices in order of first use so vertex fetch is sequential. It prints
+ACMR (cache misses per triangle) and ATVR (cache misses per vertex, 1.0 is
+optimal) of a simulated FIFO cache before and after.
+
+Usage:
+  meshtool.py convert FILE...   rewrite meshes in place as version 3 (4 if quantized)
+  meshtool.py optimize FILE...  convert and optimize meshes in place
+  meshtool.py quantize FILE...  rewrite float meshes in place with a compact version 4 layout
+  meshtool.py stats FILE...     print ACMR/ATVR
+  meshtool.py info FILE...      print header information
+"""
+
+import sys
+from struct import pack, unpack_from
+from math import sqrt
+
+MESH_VERSION = 4
+
+# Vertex attribute semantics (= shader attribute units) and types, see VertexAttribute in App.cpp.
+POSITION, NORMAL, TEXCOORD0 = 0, 1, 2
+FLOAT32, FLOAT16, SNORM16, SNORM10_10_10_2 = 0, 1, 2, 3
+HALF_UV_RANGE = 4.0        # Larger (tiling) uvs stay 32-bit, half floats get too coarse.
+
+FIFO_CACHE_SIZE = 16       # Used for the statistics, close to what older hardware has.
+FORSYTH_CACHE_SIZE = 32
+FORSYTH_DECAY_POWER = 1.5
+FORSYTH_LAST_TRI_SCORE = 0.75
+FORSYTH_VALENCE_SCALE = 2.0
+FORSYTH_VALENCE_POWER = 0.5
+OVERDRAW_THRESHOLD = 1.05  # Allowed ACMR increase when splitting into overdraw clusters.
+
+class VertexFormat:
+  def __init__(self, attributes, position_offset=(0.0, 0.0, 0.0), position_scale=1.0):
+    self.attributes = attributes # (semantic, components, type, normalized, offset)
+    self.position_offset = position_offset
+    self.position_scale = position_scale
+
+  @staticmethod
+  def from_vertex_size(vertex_size):
+    attributes = [(POSITION, 3, FLOAT32, 0, 0), (NORMAL, 3, FLOAT32, 0, 12)]
+    for uv in range((vertex_size - 24) // 8):
+      attributes.append((TEXCOORD0 + uv, 2, FLOAT32, 0, 24 + uv*8))
+    return VertexFormat(attributes)
+
+  def is_float(self):
+    return all(a[2] == FLOAT32 for a in self.attributes)
+
+  def position(self, vertex):
+    attribute = [a for a in self.attributes if a[0] == POSITION][0]
+    if attribute[2] == FLOAT32:
+      return unpack_from('<3f', vertex, attribute[4])
+    if attribute[2] == FLOAT16:
+      p = unpack_from('<3e', vertex, attribute[4])
+    else:
+      p = [x / 32767.0 for x in unpack_from('<3h', vertex, attribute[4])]
+    return tuple(self.position_offset[k] + self.position_scale * p[k] for k in range(3))
+
+  def pack(self):
+    data = pack('<I', len(self.attributes))
+    data += pack('<4f', *(tuple(self.position_offset) + (self.position_scale,)))
+    for a in self.attributes:
+      data += pack('<4BI', *a)
+    return data
+
+def read_mesh(filepath):
+  with open(filepath, 'rb') as f:
+    data = f.read()
+  version, n_vertices, n_indices, vertex_size, index_size = unpack_from('<5I', data, 0)
+  if version < 1 or version > MESH_VERSION:
+    raise ValueError('%s: unknown mesh version %d' % (filepath, version))
+  if index_size not in (2, 4):
+    raise ValueError('%s: unsupported index size %d' % (filepath, index_size))
+  offset = 20
+
+  vertex_format = VertexFormat.from_vertex_size(vertex_size)
+  if version >= 4:
+    n_attributes = unpack_from('<I', data, offset)[0]
+    values = unpack_from('<4f', data, offset + 4)
+    attributes = [unpack_from('<4BI', data, offset + 20 + i*8) for i in range(n_attributes)]
+    vertex_format = VertexFormat(attributes, values[:3], values[3])
+    offset += 20 + n_attributes*8
+
+  if len(data) < offset + n_vertices*vertex_size + n_indices*index_size:
+    raise ValueError('%s: file is truncated' % filepath)
+
+  vertices = [data[offset + i*vertex_size : offset + (i+1)*vertex_size] for i in range(n_vertices)]
+  offset += n_vertices * vertex_size
+  fmt = '<%d%s' % (n_indices, 'H' if index_size == 2 else 'I')
+  indices = list(unpack_from(fmt, data, offset))
+  return vertex_format, vertex_size, vertices, indices
+
+def weld(vertices, indices):
+  """Merges bit-identical vertices, returns new vertex list and remapped indices."""
+  unique = {}
+  welded = []
+  remap = []
+  for v in vertices:
+    if v not in unique:
+      unique[v] = len(welded)
+      welded.append(v)
+    remap.append(unique[v])
+  return welded, [remap[i] for i in indices]
+
+def write_mesh(filepath, vertex_format, vertex_size, vertices, indices):
+  """Writes version 3 for plain float layouts, version 4 otherwise."""
+  index_size = 2 if len(vertices) <= 0x10000 else 4
+  version = 3 if vertex_format.is_float() else 4
+  with open(filepath, 'wb') as f:
+    f.write(pack('<5I', version, len(vertices), len(indices), vertex_size, index_size))
+    if version >= 4:
+      f.write(vertex_format.pack())
+    for v in vertices:
+      f.write(v)
+    f.write(pack('<%d%s' % (len(indices), 'H' if index_size == 2 else 'I'), *indices))
+
+def cache_misses(indices, cache_size=FIFO_CACHE_SIZE):
+  """Simulates a FIFO post-transform cache, returns miss flag per index."""
+  cache = []
+  in_cache = set()
+  misses = []
+  for i in indices:
+    if i in in_cache:
+      misses.append(False)
+      continue
+    misses.append(True)
+    cache.append(i)
+    in_cache.add(i)
+    if len(cache) > cache_size:
+      in_cache.discard(cache.pop(0))
+  return misses
+
+def cache_stats(indices, n_vertices):
+  misses = sum(cache_misses(indices))
+  n_triangles = len(indices) // 3
+  acmr = misses / n_triangles if n_triangles else 0.0
+  atvr = misses / n_vertices if n_vertices else 0.0
+  return acmr, atvr
+
+def forsyth_vertex_score(cache_position, remaining):
+  if remaining == 0:
+    return -1.0
+  score = 0.0
+  if cache_position >= 0:
+    if cache_position < 3:
+      score = FORSYTH_LAST_TRI_SCORE
+    else:
+      scale = 1.0 / (FORSYTH_CACHE_SIZE - 3)
+      score = (1.0 - (cache_position - 3) * scale) ** FORSYTH_DECAY_POWER
+  return score + FORSYTH_VALENCE_SCALE * remaining ** -FORSYTH_VALENCE_POWER
+
+def optimize_vertex_cache(indices, n_vertices):
+  """Tom Forsyth's linear-speed vertex cache optimisation."""
+  n_triangles = len(indices) // 3
+  if n_triangles == 0:
+    return list(indices)
+
+  vertex_triangles = [[] for _ in range(n_vertices)]
+  for t in range(n_triangles):
+    for k in range(3):
+      vertex_triangles[indices[t*3+k]].append(t)
+
+  remaining = [len(tris) for tris in vertex_triangles]
+  cache_position = [-1] * n_vertices
+  vertex_score = [forsyth_vertex_score(-1, remaining[v]) for v in range(n_vertices)]
+  triangle_score = [sum(vertex_score[indices[t*3+k]] for k in range(3)) for t in range(n_triangles)]
+  emitted = [False] * n_triangles
+
+  cache = []
+  result = []
+  best = max(range(n_triangles), key=lambda t: triangle_score[t])
+  next_scan = 0
+
+  for _ in range(n_triangles):
+    if best < 0:
+      # Nothing in the cache is adjacent to unemitted triangles, scan linearly.
+      while emitted[next_scan]:
+        next_scan += 1
+      best = max((t for t in range(next_scan, n_triangles) if not emitted[t]), key=lambda t: triangle_score[t])
+
+    emitted[best] = True
+    corners = indices[best*3 : best*3+3]
+    result.extend(corners)
+
+    for v in corners:
+      remaining[v] -= 1
+      vertex_triangles[v].remove(best)
+      if v in cache:
+        cache.remove(v)
+    cache = corners + cache
+
+    touched = set(cache)
+    for v in cache[FORSYTH_CACHE_SIZE:]:
+      cache_position[v] = -1
+    del cache[FORSYTH_CACHE_SIZE:]
+    for position, v in enumerate(cache):
+      cache_position[v] = position
+
+    best = -1
+    best_score = -1.0
+    for v in touched:
+      new_score = forsyth_vertex_score(cache_position[v], remaining[v])
+      delta = new_score - vertex_score[v]
+      vertex_score[v] = new_score
+      for t in vertex_triangles[v]:
+        triangle_score[t] += delta
+    for v in cache:
+      for t in vertex_triangles[v]:
+        if triangle_score[t] > best_score:
+          best = t
+          best_score = triangle_score[t]
+
+  return result
+
+def optimize_overdraw(indices, positions, threshold=OVERDRAW_THRESHOLD):
+  """Splits the cache-optimised order into clusters and sorts them so that outward
+  facing clusters are drawn first, which lets early-z reject more of the rest."""
+  n_triangles = len(indices) // 3
+  if n_triangles < 2:
+    return list(indices)
+
+  # Hard boundaries are where the cache was flushed anyway (all three corners missed),
+  # soft boundaries are added inside them while the cluster ACMR stays within threshold.
+  misses = cache_misses(indices)
+  mesh_acmr = sum(misses) / n_triangles
+  starts = []
+  cluster_misses = 0
+  cluster_triangles = 0
+  for t in range(n_triangles):
+    corner_misses = misses[t*3] + misses[t*3+1] + misses[t*3+2]
+    if t == 0 or corner_misses == 3 or (cluster_triangles >= 8 and cluster_misses <= threshold * mesh_acmr * cluster_triangles):
+      starts.append(t)
+      cluster_misses = 0
+      cluster_triangles = 0
+    cluster_misses += corner_misses
+    cluster_triangles += 1
+  starts.append(n_triangles)
+
+  center = [sum(p[k] for p in positions) / len(positions) for k in range(3)]
+  clusters = []
+  for c in range(len(starts) - 1):
+    area_normal = [0.0, 0.0, 0.0]
+    centroid = [0.0, 0.0, 0.0]
+    area_sum = 0.0
+    for t in range(starts[c], starts[c+1]):
+      a, b, d = (positions[i] for i in indices[t*3 : t*3+3])
+      e1 = [b[k] - a[k] for k in range(3)]
+      e2 = [d[k] - a[k] for k in range(3)]
+      n = [e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0]]
+      area = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2])
+      for k in range(3):
+        area_normal[k] += n[k]
+        centroid[k] += (a[k] + b[k] + d[k]) / 3.0 * area
+      area_sum += area
+    length = sqrt(sum(x*x for x in area_normal))
+    if area_sum > 0 and length > 0:
+      centroid = [x / area_sum for x in centroid]
+      sort_key = sum((centroid[k] - center[k]) * area_normal[k] / length for k in range(3))
+    else:
+      sort_key = 0.0
+    clusters.append((-sort_key, c))
+
+  clusters.sort()
+  result = []
+  for _, c in clusters:
+    result.extend(indices[starts[c]*3 : starts[c+1]*3])
+  return result
+
+def optimize_vertex_fetch(vertices, indices):
+  """Renumbers vertices in order of first use, drops unreferenced ones."""
+  remap = {}
+  reordered = []
+  for i in indices:
+    if i not in remap:
+      remap[i] = len(reordered)
+      reordered.append(vertices[i])
+  return reordered, [remap[i] for i in indices]
+
+def quantize_vertices(vertex_format, vertices):
+  """Packs float vertices into the compact layout, returns the new format, size and data."""
+  positions = [vertex_format.position(v) for v in vertices]
+  low = [min(p[k] for p in positions) for k in range(3)]
+  high = [max(p[k] for p in positions) for k in range(3)]
+  offset = tuple((low[k] + high[k]) * 0.5 for k in range(3))
+  scale = max(high[k] - low[k] for k in range(3)) * 0.5 or 1.0
+
+  uv_attributes = [a for a in vertex_format.attributes if a[0] >= TEXCOORD0]
+  attributes = [(POSITION, 3, SNORM16, 1, 0), (NORMAL, 4, SNORM10_10_10_2, 1, 8)]
+  size = 12
+  for a in uv_attributes:
+    uvs = [unpack_from('<2f', v, a[4]) for v in vertices]
+    if max(abs(x) for uv in uvs for x in uv) <= HALF_UV_RANGE:
+      attributes.append((a[0], 2, FLOAT16, 0, size))
+      size += 4
+    else:
+      attributes.append((a[0], 2, FLOAT32, 0, size))
+      size += 8
+
+  def snorm(x, bits):
+    limit = (1 << (bits - 1)) - 1
+    return max(-limit, min(limit, int(round(x * limit))))
+
+  normal_offset = [a for a in vertex_format.attributes if a[0] == NORMAL][0][4]
+  packed = []
+  for v, p in zip(vertices, positions):
+    data = pack('<3hH', *([snorm((p[k] - offset[k]) / scale, 16) for k in range(3)] + [0]))
+    n = unpack_from('<3f', v, normal_offset)
+    length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]) or 1.0
+    x, y, z = (snorm(c / length, 10) & 0x3FF for c in n)
+    data += pack('<I', x | (y << 10) | (z << 20))
+    for a, target in zip(uv_attributes, attributes[2:]):
+      uv = unpack_from('<2f', v, a[4])
+      data += pack('<2e' if target[2] == FLOAT16 else '<2f', *uv)
+    packed.append(data)
+
+  return VertexFormat(attributes, offset, scale), size, packed
+
+def quantize(filepath):
+  vertex_format, vertex_size, vertices, indices = read_mesh(filepath)
+  if not vertex_format.is_float():
+    print('%s: already quantized' % filepath)
+    return
+  vertices, indices = weld(vertices, indices)
+  vertex_format, new_size, packed = quantize_vertices(vertex_format, vertices)
+  packed, indices = weld(packed, indices)
+  write_mesh(filepath, vertex_format, new_size, packed, indices)
+  print('%-40s vertexSize %d -> %d' % (filepath, vertex_size, new_size))
+
+def convert(filepath):
+  vertex_format, vertex_size, vertices, indices = read_mesh(filepath)
+  welded, indices = weld(vertices, indices)
+  write_mesh(filepath, vertex_format, vertex_size, welded, indices)
+  print('%s: %d -> %d vertices, %d indices' % (filepath, len(vertices), len(welded), len(indices)))
+
+def optimize(filepath):
+  vertex_format, vertex_size, vertices, indices = read_mesh(filepath)
+  vertices, indices = weld(vertices, indices)
+  before = cache_stats(indices, len(vertices))
+
+  # Each stage is only kept if it does not make the cache behaviour worse than what
+  # we started with (tiny meshes and meshes exported in strip-like order gain nothing).
+  positions = [vertex_format.position(v) for v in vertices]
+  optimized = optimize_vertex_cache(indices, len(vertices))
+  if cache_stats(optimized, len(vertices))[0] <= before[0]:
+    indices = optimized
+  optimized = optimize_overdraw(indices, positions)
+  if cache_stats(optimized, len(vertices))[0] <= OVERDRAW_THRESHOLD * before[0]:
+    indices = optimized
+  vertices, indices = optimize_vertex_fetch(vertices, indices)
+  after = cache_stats(indices, len(vertices))
+
+  write_mesh(filepath, vertex_format, vertex_size, vertices, indices)
+  print('%-40s ACMR %.3f -> %.3f   ATVR %.3f -> %.3f' % (filepath, before[0], after[0], before[1], after[1]))
+
+def stats(filepath):
+  vertex_format, vertex_size, vertices, indices = read_mesh(filepath)
+  acmr, atvr = cache_stats(indices, len(vertices))
+  print('%-40s ACMR %.3f   ATVR %.3f' % (filepath, acmr, atvr))
+
+def info(filepath):
+  with open(filepath, 'rb') as f:
+    header = unpack_from('<5I', f.read(20))
+  print('%s: version %d, %d vertices, %d indices, vertexSize %d, indexSize %d' % ((filepath,) + header))
+
+def main(args):
+  commands = {'convert': convert, 'optimize': optimize, 'quantize': quantize, 'stats': stats, 'info': info}
+  if len(args) < 2 or args[0] not in commands:
+    print(__doc__)
+    return 1
+  for filepath in args[1:]:
+    commands[args[0]](filepath)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
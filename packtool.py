@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Packs a level (.scenebin, .bullet and every asset it references) into one .pack file.
+
+A pack starts with a header of four little endian 4-byte fields: the magic "MTPK",
+the version, nEntries and namesSize. The entry table follows, nEntries records sorted
+by hash, each holding hash, type, nameOffset and nameLength (4 bytes each) and then
+offset and size (8 bytes each). Next come namesSize bytes of UTF-8 names, not
+terminated, then the entry data with every entry aligned to 16 bytes.
+
+Names are the paths the .scene file uses (relative to the scene directory), hashed
+with 32-bit FNV-1a. Entry data is written in the order BlenderScene loads it, so
+reading a level is one sequential pass over the file.
+
+Entry types: 0 raw (scenebin, bullet, shader and mesh files as they are), 1 image (an
+encoded jpg/png), 2 texture (width, height as 4 bytes each, then RGBA8 rows from
+bottom to top, which is what QGLWidget::convertToGLFormat would produce), 3 dds (a
+block compressed texture from textool.py). An image with a .dds next to it is
+stored as that .dds under the image name. Other images are converted to textures
+when PIL is available (pip install pillow), otherwise they are stored encoded.
+
+The .scenebin is compiled from the .scene with scenetool.py on the fly. The game
+picks up level1.pack next to level1.scenebin automatically.
+
+Usage:
+  packtool.py pack SCENE [PACK] [--encoded]   pack a scene (default PACK: next to SCENE)
+  packtool.py list PACK                        print the entries of a pack
+"""
+
+import os
+import sys
+from struct import pack, unpack_from
+from xml.etree import ElementTree
+
+from scenetool import compile_scene
+
+MAGIC = b'MTPK'
+VERSION = 1
+HEADER_SIZE = 16
+ENTRY_SIZE = 32
+ALIGNMENT = 16
+
+RAW, IMAGE, TEXTURE, DDS = 0, 1, 2, 3
+TYPE_NAMES = {RAW: 'raw', IMAGE: 'image', TEXTURE: 'texture', DDS: 'dds'}
+IMAGE_EXTENSIONS = ('.jpg', '.jpeg', '.png')
+
+# Same order the attributes are loaded in BlenderScene::BlenderScene.
+OBJECT_ASSETS = ('texture0', 'texture1', 'texture2', 'texture3', 'texture4', 'mesh', 'shader')
+
+def fnv1a(data):
+  h = 2166136261
+  for byte in data:
+    h = ((h ^ byte) * 16777619) & 0xffffffff
+  return h
+
+def convert_image(filepath):
+  """Returns (type, data) for an image, decoded to bottom-up RGBA8 if PIL is around."""
+  dds = os.path.splitext(filepath)[0] + '.dds'
+  if os.path.isfile(dds):
+    with open(dds, 'rb') as f:
+      return DDS, f.read()
+  try:
+    from PIL import Image
+  except ImportError:
+    with open(filepath, 'rb') as f:
+      return IMAGE, f.read()
+  image = Image.open(filepath).convert('RGBA').transpose(Image.FLIP_TOP_BOTTOM)
+  return TEXTURE, pack('<II', image.size[0], image.size[1]) + image.tobytes()
+
+def collect(scene_path, encoded):
+  """Returns [(name, type, data)] in load order."""
+  directory = os.path.dirname(os.path.abspath(scene_path))
+  base = os.path.splitext(os.path.basename(scene_path))[0]
+  entries = [(base + '.scenebin', RAW, compile_scene(scene_path))]
+  names = []
+  if os.path.exists(os.path.join(directory, base + '.bullet')):
+    names.append(base + '.bullet')
+  for obj in ElementTree.parse(scene_path).getroot().iter('object'):
+    for attribute in OBJECT_ASSETS:
+      name = obj.get(attribute)
+      if name is not None and name not in names:
+        names.append(name)
+
+  for name in names:
+    filepath = os.path.join(directory, name)
+    if not os.path.isfile(filepath):
+      sys.exit('%s: %s does not exist' % (scene_path, filepath))
+    if not encoded and name.lower().endswith(IMAGE_EXTENSIONS):
+      entry_type, data = convert_image(filepath)
+    else:
+      with open(filepath, 'rb') as f:
+        entry_type, data = RAW, f.read()
+    entries.append((name, entry_type, data))
+  return entries
+
+def write_pack(filepath, entries):
+  names = b''
+  table = []
+  offset = HEADER_SIZE + ENTRY_SIZE * len(entries) + sum(len(name.encode('utf-8')) for name, _, _ in entries)
+  for name, entry_type, data in entries:
+    utf8 = name.encode('utf-8')
+    offset = (offset + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+    table.append((fnv1a(utf8), entry_type, len(names), len(utf8), offset, len(data)))
+    names += utf8
+    offset += len(data)
+
+  with open(filepath, 'wb') as f:
+    f.write(MAGIC + pack('<3I', VERSION, len(entries), len(names)))
+    for row in sorted(table):
+      f.write(pack('<4I2Q', *row))
+    f.write(names)
+    for (_, _, data), row in zip(entries, table):
+      f.write(b'\0' * (row[4] - f.tell()))
+      f.write(data)
+  return offset
+
+def pack_scene(args):
+  encoded = '--encoded' in args
+  args = [a for a in args if a != '--encoded']
+  scene_path = args[0]
+  pack_path = args[1] if len(args) > 1 else os.path.splitext(scene_path)[0] + '.pack'
+  entries = collect(scene_path, encoded)
+  size = write_pack(pack_path, entries)
+  if any(entry_type == IMAGE for _, entry_type, _ in entries) and not encoded:
+    print('PIL not found, images were stored encoded')
+  print('%s: %d entries, %d bytes' % (pack_path, len(entries), size))
+
+def list_pack(args):
+  with open(args[0], 'rb') as f:
+    data = f.read()
+  if data[:4] != MAGIC:
+    print('%s: not a pack' % args[0])
+    return
+  version, n_entries, names_size = unpack_from('<3I', data, 4)
+  names = HEADER_SIZE + ENTRY_SIZE * n_entries
+  rows = [unpack_from('<4I2Q', data, HEADER_SIZE + i * ENTRY_SIZE) for i in range(n_entries)]
+  for h, entry_type, name_offset, name_length, offset, size in sorted(rows, key=lambda row: row[4]):
+    name = data[names + name_offset:names + name_offset + name_length].decode('utf-8')
+    print('%08x %-8s %10d %10d  %s' % (h, TYPE_NAMES.get(entry_type, '?'), offset, size, name))
+
+def main(args):
+  commands = {'pack': pack_scene, 'list': list_pack}
+  if len(args) < 2 or args[0] not in commands:
+    print(__doc__)
+    return 1
+  commands[args[0]](args[1:])
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
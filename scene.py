@@ -1,7 +1,7 @@
 bl_addon_info = {
 "name": "SCENE Export",
 "author": "Matej Drame",
-"version": (0, 2),
+"version": (0, 3),
 "blender": (2, 5, 7),
 "api": 35266,
 "location": "File > Export",
@@ -21,12 +21,12 @@ import os
 def export_mesh(obj, scene_path, mesh_name):
   """
   // Format:
-  // format version (1 byte)
+  // format version (4 bytes)
   // nVertices (4 bytes)
   // nIndices (4 bytes)
-  // vertexSize (1 byte)
-  // indexSize (1 byte)
-  // vertexBuffer (nVertices * vertexSize)
+  // vertexSize (4 bytes)
+  // indexSize (4 bytes, 2 if nVertices <= 65536, otherwise 4)
+  // vertexBuffer (nVertices * vertexSize), welded (unique) vertices
   // indexBuffer (nIndices * indexSize)
   """
   #bpy.ops.object.mode_set(mode='EDIT')
@@ -69,23 +69,35 @@ def export_mesh(obj, scene_path, mesh_name):
       vertex.append(coords.uv3)
     vertices.append(vertex)
 
+  # Weld corners that share position, normal and uvs.
+  unique = {}
+  packed = []
+  indices = []
+  for v in vertices:
+    data = pack('<fff', *v[0]) + pack('<fff', *v[1])
+    for uv in v[2:]:
+      data += pack('<ff', *uv)
+    if data not in unique:
+      unique[data] = len(packed)
+      packed.append(data)
+    indices.append(unique[data])
+
   filepath = os.path.join(os.path.dirname(scene_path), mesh_name)
   with open(filepath, 'wb') as f:
-    f.write(pack('<I', 2))
-    f.write(pack('<I', len(vertices)))
-    f.write(pack('<I', len(vertices)))
+    index_size = 2 if len(packed) <= 0x10000 else 4
+    f.write(pack('<I', 3))
+    f.write(pack('<I', len(packed)))
+    f.write(pack('<I', len(indices)))
     vertex_size = sum(len(component)*4 for component in vertices[0])
     f.write(pack('<I', vertex_size))
-    f.write(pack('<I', 4))
+    f.write(pack('<I', index_size))
 
-    for v in vertices:
-      f.write(pack('<fff', *v[0]))
-      f.write(pack('<fff', *v[1]))
-      for uv in v[2:]:
-        f.write(pack('<ff', *uv))
+    for data in packed:
+      f.write(data)
 
-    for index in range(len(vertices)):
-      f.write(pack('<I', index))
+    index_format = '<H' if index_size == 2 else '<I'
+    for index in indices:
+      f.write(pack(index_format, index))
 
 class SceneExporter(bpy.types.Operator, ExportHelper):
   '''Exports to SCENE'''
@@ -108,6 +120,7 @@ class SceneExporter(bpy.types.Operator, ExportHelper):
       Object with the same base name (before dot) are consider to be instances of the same mesh -
       those meshes are exported only once.
       Object must have materials applied (one material max, but unlimited uvs/textures).
+      The game reads the compiled form, run scenetool.py convert on the .scene afterwards.
     """
     objects = [object for object in bpy.context.visible_objects if object.type == 'MESH']
     with open(self.filepath, 'w') as f:
@@ -131,6 +144,8 @@ class SceneExporter(bpy.types.Operator, ExportHelper):
         f.write('name="%s" shader="%s" mesh="%s"' % (obj.name, shader, mesh))
         if 'transparent' in obj.game.properties and obj.game.properties['transparent'].value:
           f.write(' transparent="true"')
+        if 'nobatch' in obj.game.properties and obj.game.properties['nobatch'].value:
+          f.write(' nobatch="true"')
         for i in range(n_slots):
           f.write(' texture%d="%s"' % (i, os.path.basename(slots[i].texture.image.filepath)))
         f.write('>\n')
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Compiles .scene files (the XML written by the Blender exporter) into .scenebin.
+
+A .scenebin starts with a header of six little endian 4-byte fields: the magic
+"MTSC", the version, nStrings, stringsSize, nAssets and nObjects. It is followed by
+nStrings 4-byte offsets into the string data, then stringsSize bytes of UTF-8
+strings, each NUL terminated and padded to 4 bytes. The asset table holds nAssets
+records of type and string (4 bytes each), type 0 is a texture, 1 a mesh and 2 a
+shader. Last come nObjects records of name, flags, mesh, shader and texture0 to
+texture4 (4 bytes each), then the position (3 floats) and the rotation (4 floats,
+x y z w).
+
+Object fields refer to the string and asset tables by index, -1 when an object has
+no such attribute. Asset names are paths relative to the scene, as in the XML.
+Flags: 1 transparent, 2 has a position and rotation (needed for objects without a
+rigid body in the .bullet file), 4 nobatch (never merged into a static batch, for
+objects the game moves or toggles by name).
+
+The game only reads .scenebin, the XML stays the authoring format.
+
+Usage:
+  scenetool.py convert FILE...   write FILE.scenebin next to each .scene
+  scenetool.py info FILE...      print the tables of a .scenebin
+"""
+
+import os
+import sys
+from struct import pack, unpack_from
+from xml.etree import ElementTree
+
+MAGIC = b'MTSC'
+VERSION = 1
+HEADER_SIZE = 24
+OBJECT_SIZE = 64
+
+TEXTURE, MESH, SHADER = 0, 1, 2
+TYPE_NAMES = {TEXTURE: 'texture', MESH: 'mesh', SHADER: 'shader'}
+TRANSPARENT, HAS_TRANSFORM, NO_BATCH = 1, 2, 4
+TEXTURE_ATTRIBUTES = ('texture0', 'texture1', 'texture2', 'texture3', 'texture4')
+
+class Tables:
+  def __init__(self):
+    self.strings = []
+    self.string_index = {}
+    self.assets = []
+    self.asset_index = {}
+
+  def string(self, s):
+    if s not in self.string_index:
+      self.string_index[s] = len(self.strings)
+      self.strings.append(s)
+    return self.string_index[s]
+
+  def asset(self, asset_type, name):
+    if name is None:
+      return -1
+    key = (asset_type, name)
+    if key not in self.asset_index:
+      self.asset_index[key] = len(self.assets)
+      self.assets.append((asset_type, self.string(name)))
+    return self.asset_index[key]
+
+def transform(obj):
+  position = obj.find('position')
+  rotation = obj.find('rotation')
+  try:
+    return ([float(position.get(a)) for a in 'xyz'], [float(rotation.get(a)) for a in 'xyzw'])
+  except (AttributeError, TypeError, ValueError):
+    return None
+
+def compile_scene(scene_path):
+  """Returns the .scenebin bytes for an XML scene."""
+  tables = Tables()
+  records = []
+  for obj in ElementTree.parse(scene_path).getroot().iter('object'):
+    flags = 0
+    if obj.get('transparent') is not None:
+      flags |= TRANSPARENT
+    if obj.get('nobatch') is not None:
+      flags |= NO_BATCH
+    position, rotation = [0.0] * 3, [0.0, 0.0, 0.0, 1.0]
+    t = transform(obj)
+    if t is not None:
+      flags |= HAS_TRANSFORM
+      position, rotation = t
+    # Assets are added in the order the game used to load them.
+    textures = [tables.asset(TEXTURE, obj.get(a)) for a in TEXTURE_ATTRIBUTES]
+    mesh = tables.asset(MESH, obj.get('mesh'))
+    shader = tables.asset(SHADER, obj.get('shader'))
+    name = tables.string(obj.get('name', ''))
+    records.append(pack('<2I7i7f', name, flags, mesh, shader, *(textures + position + rotation)))
+
+  offsets = []
+  strings = b''
+  for s in tables.strings:
+    offsets.append(len(strings))
+    strings += s.encode('utf-8') + b'\0'
+  strings += b'\0' * (-len(strings) % 4)
+
+  data = MAGIC + pack('<5I', VERSION, len(tables.strings), len(strings), len(tables.assets), len(records))
+  data += pack('<%dI' % len(offsets), *offsets) + strings
+  for asset_type, string in tables.assets:
+    data += pack('<2I', asset_type, string)
+  return data + b''.join(records)
+
+def scenebin_path(scene_path):
+  return os.path.splitext(scene_path)[0] + '.scenebin'
+
+def convert(filepath):
+  data = compile_scene(filepath)
+  with open(scenebin_path(filepath), 'wb') as f:
+    f.write(data)
+  n_strings, strings_size, n_assets, n_objects = unpack_from('<4I', data, 8)
+  print('%s: %d objects, %d assets, %d bytes' % (scenebin_path(filepath), n_objects, n_assets, len(data)))
+
+def info(filepath):
+  with open(filepath, 'rb') as f:
+    data = f.read()
+  if data[:4] != MAGIC:
+    print('%s: not a .scenebin' % filepath)
+    return
+  version, n_strings, strings_size, n_assets, n_objects = unpack_from('<5I', data, 4)
+  offsets = unpack_from('<%dI' % n_strings, data, HEADER_SIZE)
+  base = HEADER_SIZE + 4 * n_strings
+  strings = [data[base + o:data.index(b'\0', base + o)].decode('utf-8') for o in offsets]
+  base += strings_size
+  print('%s: version %d, %d strings, %d assets, %d objects' % (filepath, version, n_strings, n_assets, n_objects))
+  for i in range(n_assets):
+    asset_type, string = unpack_from('<2I', data, base + 8 * i)
+    print('  asset %3d %-7s %s' % (i, TYPE_NAMES.get(asset_type, '?'), strings[string]))
+
+def main(args):
+  commands = {'convert': convert, 'info': info}
+  if len(args) < 2 or args[0] not in commands:
+    print(__doc__)
+    return 1
+  for filepath in args[1:]:
+    commands[args[0]](filepath)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+"""Offline texture compression, writes block compressed .dds files with full mip chains.
+
+Every image gets a .dds next to it (grass.jpg -> grass.dds), which the renderer
+loads instead of the image when it exists (and packtool.py packs instead of the
+image). The format is picked per image:
+  BC1 (DXT1)  opaque colour, 4 bits per pixel
+  BC3 (DXT5)  colour with alpha, 8 bits per pixel
+Normal maps (file name ending in -normal) are stored as BC1 like any other colour
+for now. BC5 (ATI2, x and y only) can be read by the renderer and by info, but
+is only worth writing once the shaders sampling normal maps reconstruct
+z = sqrt(1 - x*x - y*y).
+
+Mip levels are box filtered down to 1x1. Rows are stored bottom to top, which is
+what glCompressedTexImage2D expects and what QGLWidget::convertToGLFormat does for
+the uncompressed path - unlike most DDS writers, so don't feed these to other tools.
+
+Colour endpoints are fitted along the principal axis of each 4x4 block, which is
+slower than a bounding box fit but avoids the worst banding on gradients.
+
+Requires PIL and numpy (pip install pillow numpy), neither ships with the repo.
+
+Usage:
+  textool.py compress FILE...   write FILE.dds for each image
+  textool.py info FILE...       print the header of .dds files
+"""
+
+import os
+import sys
+from struct import pack, unpack_from
+
+try:
+  import numpy as np
+  from PIL import Image
+except ImportError:
+  np = Image = None
+
+DDS_MAGIC = b'DDS '
+DDSD_CAPS, DDSD_HEIGHT, DDSD_WIDTH, DDSD_PIXELFORMAT = 0x1, 0x2, 0x4, 0x1000
+DDSD_MIPMAPCOUNT, DDSD_LINEARSIZE = 0x20000, 0x80000
+DDPF_FOURCC = 0x4
+DDSCAPS_COMPLEX, DDSCAPS_TEXTURE, DDSCAPS_MIPMAP = 0x8, 0x1000, 0x400000
+
+BLOCK_BYTES = {b'DXT1': 8, b'DXT5': 16, b'ATI2': 16}
+
+def dds_path(filepath):
+  return os.path.splitext(filepath)[0] + '.dds'
+
+def blocks(pixels):
+  """Splits an (h, w, c) array into (n, 16, c) 4x4 blocks, edges are replicated."""
+  h, w, c = pixels.shape
+  bh, bw = (h + 3) // 4, (w + 3) // 4
+  padded = np.pad(pixels, ((0, bh * 4 - h), (0, bw * 4 - w), (0, 0)), mode='edge')
+  return padded.reshape(bh, 4, bw, 4, c).transpose(0, 2, 1, 3, 4).reshape(bh * bw, 16, c)
+
+def to565(colors):
+  c = np.clip(np.rint(colors * [31.0 / 255, 63.0 / 255, 31.0 / 255]), 0, [31, 63, 31]).astype(np.uint32)
+  return (c[..., 0] << 11) | (c[..., 1] << 5) | c[..., 2]
+
+def from565(values):
+  r, g, b = (values >> 11) & 31, (values >> 5) & 63, values & 31
+  return np.stack([r * 255.0 / 31, g * 255.0 / 63, b * 255.0 / 31], axis=-1)
+
+def encode_colors(rgb):
+  """BC1 colour blocks (always in 4 colour mode) for (n, 16, 3) float blocks."""
+  mean = rgb.mean(axis=1, keepdims=True)
+  centered = rgb - mean
+  covariance = np.einsum('nki,nkj->nij', centered, centered)
+  axis = np.ones((len(rgb), 3)) / np.sqrt(3)
+  for _ in range(8):
+    axis = np.einsum('nij,nj->ni', covariance, axis)
+    axis /= np.maximum(np.linalg.norm(axis, axis=1, keepdims=True), 1e-8)
+  projection = np.einsum('nki,ni->nk', centered, axis)
+  lo = mean[:, 0] + projection.min(axis=1)[:, None] * axis
+  hi = mean[:, 0] + projection.max(axis=1)[:, None] * axis
+
+  c0, c1 = to565(hi), to565(lo)
+  swap = c0 < c1
+  c0[swap], c1[swap] = c1[swap], c0[swap]
+  e0, e1 = from565(c0), from565(c1)
+  palette = np.stack([e0, e1, (2 * e0 + e1) / 3, (e0 + 2 * e1) / 3], axis=1)
+  distances = ((rgb[:, :, None, :] - palette[:, None, :, :]) ** 2).sum(axis=3)
+  indices = distances.argmin(axis=2).astype(np.uint32)
+  indices[c0 == c1] = 0
+
+  bits = (indices << (2 * np.arange(16, dtype=np.uint32))).sum(axis=1, dtype=np.uint64).astype(np.uint32)
+  out = np.zeros((len(rgb), 2), dtype='<u4')
+  out[:, 0] = c0 | (c1 << 16)
+  out[:, 1] = bits
+  return out.view(np.uint8).reshape(len(rgb), 8)
+
+def encode_channel(values):
+  """BC4 blocks (the BC3 alpha block, half of BC5) for (n, 16) float blocks."""
+  a0 = np.rint(values.max(axis=1)).astype(np.int64)
+  a1 = np.rint(values.min(axis=1)).astype(np.int64)
+  span = np.maximum(a0 - a1, 1)[:, None]
+  ramp = np.clip(np.rint((a0[:, None] - values) * 7 / span), 0, 7).astype(np.uint64)
+  # Ramp position 0 is a0, 7 is a1 and 1-6 are the interpolated values 2-7.
+  indices = np.where(ramp == 0, 0, np.where(ramp == 7, 1, ramp + 1)).astype(np.uint64)
+  indices[a0 == a1] = 0
+  bits = (indices << (3 * np.arange(16, dtype=np.uint64))).sum(axis=1, dtype=np.uint64)
+  out = np.zeros((len(values), 8), dtype=np.uint8)
+  out[:, 0] = a0
+  out[:, 1] = a1
+  for i in range(6):
+    out[:, 2 + i] = (bits >> np.uint64(8 * i)) & np.uint64(255)
+  return out
+
+def encode(pixels, fourcc):
+  b = blocks(pixels.astype(np.float64))
+  if fourcc == b'DXT1':
+    return encode_colors(b[:, :, :3]).tobytes()
+  if fourcc == b'DXT5':
+    return np.concatenate([encode_channel(b[:, :, 3]), encode_colors(b[:, :, :3])], axis=1).tobytes()
+  return np.concatenate([encode_channel(b[:, :, 0]), encode_channel(b[:, :, 1])], axis=1).tobytes()
+
+def pick_format(image):
+  if image.mode in ('RGBA', 'LA', 'PA') or 'transparency' in image.info:
+    if image.convert('RGBA').getextrema()[3][0] < 255:
+      return b'DXT5'
+  return b'DXT1'
+
+def mip_chain(image):
+  levels = [image]
+  while image.size != (1, 1):
+    image = image.resize((max(image.size[0] // 2, 1), max(image.size[1] // 2, 1)), Image.BOX)
+    levels.append(image)
+  return levels
+
+def dds_header(width, height, n_levels, fourcc, top_level_size):
+  flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE
+  header = pack('<7I', 124, flags, height, width, top_level_size, 0, n_levels) + b'\0' * 44
+  header += pack('<2I', 32, DDPF_FOURCC) + fourcc + b'\0' * 20
+  header += pack('<4I', DDSCAPS_COMPLEX | DDSCAPS_TEXTURE | DDSCAPS_MIPMAP, 0, 0, 0) + b'\0' * 4
+  return DDS_MAGIC + header
+
+def compress(filepath):
+  if np is None:
+    sys.exit('textool.py needs PIL and numpy')
+  source = Image.open(filepath)
+  fourcc = pick_format(source)
+  image = source.convert('RGBA').transpose(Image.FLIP_TOP_BOTTOM)
+  data = [encode(np.asarray(level), fourcc) for level in mip_chain(image)]
+  with open(dds_path(filepath), 'wb') as f:
+    f.write(dds_header(image.size[0], image.size[1], len(data), fourcc, len(data[0])))
+    for level in data:
+      f.write(level)
+  raw = sum(l.size[0] * l.size[1] * 4 for l in mip_chain(image))
+  print('%-40s %s %dx%d, %d levels, %d -> %d bytes' % (dds_path(filepath), fourcc.decode(),
+    image.size[0], image.size[1], len(data), raw, sum(len(l) for l in data)))
+
+def info(filepath):
+  with open(filepath, 'rb') as f:
+    data = f.read(128)
+  if data[:4] != DDS_MAGIC:
+    print('%s: not a .dds' % filepath)
+    return
+  height, width = unpack_from('<2I', data, 12)
+  n_levels = unpack_from('<I', data, 28)[0]
+  fourcc = data[84:88]
+  print('%s: %s %dx%d, %d levels' % (filepath, fourcc.decode('latin-1'), width, height, n_levels))
+
+def main(args):
+  commands = {'compress': compress, 'info': info}
+  if len(args) < 2 or args[0] not in commands:
+    print(__doc__)
+    return 1
+  for filepath in args[1:]:
+    commands[args[0]](filepath)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))